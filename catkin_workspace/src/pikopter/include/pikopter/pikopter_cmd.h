@@ -10,13 +10,25 @@
 #include <mavros_msgs/SetMode.h>
 #include <mavros_msgs/CommandBool.h>
 #include <mavros_msgs/CommandLong.h>
-#include <geometry_msgs/TwistStamped.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <geometry_msgs/Vector3.h>
 #include <mavros_msgs/PositionTarget.h>
+#include <mavros_msgs/State.h>
 #include "std_msgs/Float64.h"
 #include "std_msgs/Bool.h"
+#include "std_msgs/String.h"
+#include "std_msgs/UInt8.h"
+#include "std_msgs/UInt32MultiArray.h"
 #include <cmath>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include "ros/callback_queue.h"
+#include "sys/epoll.h"
+#include "sys/timerfd.h"
+#include "sys/eventfd.h"
+#include "poll.h"
+#include "boost/make_shared.hpp"
 
 
 
@@ -24,12 +36,330 @@
 // The port used for the commands
 #define PORT_CMD 5556
 #define MAX_SPEED_CMD 3
-#define MAX_VEL_TURN_CMD 45
+#define MAX_VEL_TURN_CMD 45  // In degrees per second
 
 
 #define RATIO_Z 1
 
+// Shaping of the stick values, see convertSpeedARDroneToRate()
+#define STICK_DEADBAND 0.0  // Values below are ignored, in [0, 1[
+#define STICK_EXPO 0.0  // 0 for a linear response, 1 for a cubic one
+
+// PCMD flag telling that the angles must be used, otherwise the drone hovers
+#define PCMD_PROGRESSIVE_FLAG 1
+
+// Setpoint carrying vx, vy, vz and yaw_rate (positions, accelerations and yaw ignored)
+#define SETPOINT_VELOCITY_YAW_RATE_MASK (mavros_msgs::PositionTarget::IGNORE_PX | mavros_msgs::PositionTarget::IGNORE_PY | \
+	mavros_msgs::PositionTarget::IGNORE_PZ | mavros_msgs::PositionTarget::IGNORE_AFX | mavros_msgs::PositionTarget::IGNORE_AFY | \
+	mavros_msgs::PositionTarget::IGNORE_AFZ | mavros_msgs::PositionTarget::IGNORE_YAW)
+
+// Maximum number of datagrams drained by one wakeup of the receive loop
+#define CMD_BATCH_SIZE 16
+
+// Size of a packet slot, the SDK sends AT datagrams of at most 1024 bytes
+#define CMD_DATAGRAM_SIZE 1024
+
+// A ping is sent to the client after this silence on the command channel
+#define CMD_PING_PERIOD_MS 100
+
+// Events handled by one wakeup of the event loop (socket, timer, callbacks, stop)
+#define CMD_EPOLL_EVENTS 4
+
+// Link-loss watchdog: silence of the command channel before hovering, then landing
+#define CMD_WATCHDOG_HOVER_MS 500
+#define CMD_WATCHDOG_LAND_MS 5000
+
+// Number of wakeups between two displays of the batch statistics
+#define CMD_BATCH_STATS_PERIOD 1000
+
+// Number of datagrams between two displays of the parser statistics
+#define CMD_PARSER_STATS_PERIOD 1000
+
+// Commands of a class waiting between the parser and their execution, a class full runs the next one at once
+#define CMD_SCHEDULER_DEPTH 32
+
+// Number of batches between two displays of the scheduler statistics
+#define CMD_SCHEDULER_STATS_PERIOD 1000
+
+// Number of command sessions, the station given by the ip parameter included
+#define CMD_MAX_CLIENTS 8
+
+// A session silent for this long is forgotten (the station given by the ip parameter never is)
+#define CMD_SESSION_TIMEOUT_MS 10000
+
+// Silence of the pilot after which another session can take the control
+#define CMD_PILOT_TIMEOUT_MS 2000
+
+// Datagrams waiting longer than this in the socket are discarded
+#define CMD_MAX_AGE_MS 250
+
+// A jump of the realtime clock against the monotonic one larger than this between two batches is a step (NTP)
+#define CMD_CLOCK_STEP_MS 100
+
+// Sequence number sent by a client which restarts its numbering
+#define AT_SEQ_RESET 1
+
+// Maximum number of arguments after the sequence number of an AT command
+#define AT_MAX_ARGS 8
+
+// Values of the AT*REF argument
+#define AT_REF_TAKEOFF 290718208
+#define AT_REF_LAND 290717696
+#define AT_REF_EMERGENCY 290717952
+#define AT_REF_EMERGENCY_BIT 0x100  // Bit 8 of the AT*REF argument, set in the emergency value
+
+// AT*CONFIG key switching the navdata between demo and full mode, and its values
+#define CONFIG_NAVDATA_DEMO "general:navdata_demo"
+#define CONFIG_TRUE "TRUE"
+#define CONFIG_FALSE "FALSE"
+
+// Emergency cut-off: force disarm, MAV_CMD_COMPONENT_ARM_DISARM with the magic value in param2
+#define MAV_CMD_COMPONENT_ARM_DISARM 400
+#define MAV_FORCE_DISARM_MAGIC 21196
+
+// Harmless command opening the connection of the cut-off at start (MAV_CMD_REQUEST_AUTOPILOT_CAPABILITIES)
+#define MAV_CMD_REQUEST_AUTOPILOT_CAPABILITIES 520
+
+// Bound on the time between the reception of an emergency and its call to mavros, a cut-off above it is reported
+#define EMERGENCY_LATENCY_BOUND_US 2000
+
+// SCHED_FIFO priority of the cut-off thread (0 keeps the default policy)
+#define EMERGENCY_FIFO_PRIORITY 0
+
+// Period of the force disarm calls until mavros acknowledges one
+#define EMERGENCY_RETRY_MS 50
+
+// After an acknowledged force disarm, the emergencies repeated by the client during this time are not sent again
+#define EMERGENCY_ACK_HOLD_MS 500
+
+// Altitude reached after taking off (in meters)
+#define TAKEOFF_ALTITUDE 5
+
+// Operations waiting for the executor thread (one slot is kept empty)
+#define EXECUTOR_QUEUE_SIZE 8
+
+// Period of the executor state machine while an operation runs
+#define EXECUTOR_TICK_MS 20
+
+// Wait of the executor thread when there is nothing to do
+#define EXECUTOR_IDLE_WAIT_MS 500
+
+// Time given to mavros to reach the state asked by a stage
+#define EXECUTOR_STAGE_TIMEOUT_MS 5000
+
+// Rate at which the last commanded velocity is republished (in hertz)
+#define SETPOINT_STREAM_RATE 20
+
+// The stream stops after this silence of the PCMD commands
+#define SETPOINT_SILENCE_MS 1000
+
+// Setpoint carrying x, y, z and yaw (velocities, accelerations and yaw rate ignored)
+#define SETPOINT_POSITION_YAW_MASK (mavros_msgs::PositionTarget::IGNORE_VX | mavros_msgs::PositionTarget::IGNORE_VY | \
+	mavros_msgs::PositionTarget::IGNORE_VZ | mavros_msgs::PositionTarget::IGNORE_AFX | mavros_msgs::PositionTarget::IGNORE_AFY | \
+	mavros_msgs::PositionTarget::IGNORE_AFZ | mavros_msgs::PositionTarget::IGNORE_YAW_RATE)
+
+// Points of a trajectory uploaded with AT*PTRAJ, sent in several chunks if needed
+#define TRAJECTORY_MAX_POINTS 64
+
+// Rate at which the setpoints of a trajectory are fed to the stream (in hertz)
+#define TRAJECTORY_RATE 50
+
+// Period of the progress published while a trajectory runs
+#define TRAJECTORY_PROGRESS_PERIOD_MS 100
+
+// Flags of AT*PTRAJ
+#define PTRAJ_FLAG_MORE 1  // More chunks follow, the trajectory starts with the last one
+#define PTRAJ_FLAG_POSITION 2  // Points in the local frame (cm, deg), otherwise velocities in the body frame (cm/s, deg/s)
+
+
+
+/* ################################### TYPE DEF ################################### */
+
+// Verbs of the AT commands known by the parser
+typedef enum {
+	AT_UNKNOWN,
+	AT_REF,
+	AT_PCMD,
+	AT_PCMD_MAG,
+	AT_FTRIM,
+	AT_CONFIG,
+	AT_CONFIG_IDS,
+	AT_COMWDG,
+	AT_CALIB,
+	AT_CTRL,
+	AT_LED,
+	AT_ANIM,
+	AT_PTRAJ  // Pikopter extension, upload of a trajectory
+} at_verb;
+
+// An argument of an AT command, strings point into the received datagram
+struct at_arg {
+	int32_t value;  // Integer value, 0 for a string
+	const char *str;  // Start of the quoted string without the quotes, NULL for an integer
+	uint16_t len;  // Length of the quoted string
+};
+
+// A tokenized AT command: AT*VERB=seq,arg1,arg2,...
+struct at_command {
+	at_verb verb;
+	int64_t received;  // Kernel reception time of its datagram (CLOCK_REALTIME ns), 0 if unknown
+	int32_t seq;  // Sequence number
+	int nargs;  // Number of arguments after the sequence number
+	struct at_arg args[AT_MAX_ARGS];
+};
+
+// Long operations run by the executor thread
+typedef enum {
+	OP_NONE,
+	OP_TAKEOFF,
+	OP_LAND
+} executor_op;
+
+// Stages of the operations
+typedef enum {
+	STAGE_IDLE,
+	STAGE_SET_GUIDED,
+	STAGE_WAIT_GUIDED,
+	STAGE_ARM,
+	STAGE_WAIT_ARMED,
+	STAGE_TAKEOFF,
+	STAGE_LAND
+} executor_stage;
+
+// Change detection state of the parser (values of the previous commands)
+struct parser_state {
+	int32_t ptcmd;
+	int32_t pp1, pp2, pp3, pp4, pp5;
+};
+
+// Command session of a client, keyed by its address
+struct cmd_client {
+	struct sockaddr_in addr;  // Source of its datagrams, target of its pings
+	bool active;
+	bool permanent;  // The station given by the ip parameter, never forgotten
+	bool pilot;  // This session controls the drone, the others only observe
+	bool may_pilot;  // No pilot and this address is allowed: its next control command takes the control
+	int32_t last_seq;  // Last sequence number accepted
+	struct parser_state state;  // Change detection of its own commands
+	int64_t last_received;  // Monotonic time of its last datagram (ns)
+	int64_t last_ping;  // Monotonic time of the last ping sent to it (ns)
+};
+
+// Counters of the parser
+struct parser_stats {
+	unsigned long datagrams;  // Datagrams parsed
+	unsigned long commands;  // Commands executed
+	unsigned long malformed;  // Commands which could not be tokenized
+	unsigned long unknown;  // Commands with an unknown verb or missing arguments
+	unsigned long verbs[AT_PTRAJ + 1];  // Commands executed by verb
+
+	// Drops by reason
+	unsigned long dropped_too_old;  // Datagrams which waited more than the maximum age
+	unsigned long dropped_truncated;  // Datagrams larger than a packet slot
+	unsigned long clock_steps;  // Datagrams whose age was not checked, the realtime clock stepped
+	unsigned long dropped_duplicate;  // Commands with the last sequence number accepted
+	unsigned long dropped_stale;  // Commands older than the last one accepted (reordered)
+	unsigned long dropped_observer;  // Control commands sent by a session which is not the pilot
+	unsigned long dropped_superseded;  // Commands replaced by a newer one before their execution
+};
+
+// Priority classes of the scheduler, in the order they run
+typedef enum {
+	CLASS_SAFETY,  // Emergency and land, preempt everything
+	CLASS_CONTROL,  // Takeoff, configuration and the other commands
+	CLASS_MOTION,  // PCMD, only the newest one runs
+	CLASS_COUNT
+} command_class;
+
+// A command waiting in the scheduler, its strings point into the datagram of the batch
+struct scheduled_command {
+	struct at_command command;
+	struct cmd_client *client;  // Session whose change detection state is used
+	int64_t queued;  // Monotonic time of its parsing (ns)
+	bool superseded;  // Replaced by a newer command, not executed
+};
+
+// Counters of a class of the scheduler
+struct scheduler_class_stats {
+	unsigned long executed;
+	unsigned long superseded;
+	unsigned long batches;  // Batches with commands of this class
+	unsigned long depth_sum;  // Commands waiting when the batch is drained
+	unsigned int depth_max;
+	int64_t wait_sum;  // Time between the parsing and the execution (ns)
+	int64_t wait_max;
+};
+
+// A point of a trajectory, its setpoint is held for its duration
+struct trajectory_point {
+	uint32_t duration_ms;
+	float x, y, z;  // Velocity (m/s) or position (m)
+	float yaw;  // Yaw rate (rad/s) or yaw (rad)
+};
+
+// Parameters of the node, read from its private namespace
+struct cmd_params {
+	std::string ip;  // The station, always a session
+	int batch_size;
+	int max_age_ms;
+	int ping_period_ms;
+	int hover_ms;
+	int land_ms;
+	std::string pilot_ip;  // Empty for the first client flying
+	int pilot_timeout_ms;
+};
+
 /* ################################### Classes ################################### */
+class ExecuteCommand;
+
+/*!
+ * \brief ROS callback queue which signals an eventfd when a callback is queued
+ * so that the event loop of the cmd node can wait for it with epoll
+ */
+class EventfdCallbackQueue : public ros::CallbackQueue {
+
+	// Public part
+	public:
+		EventfdCallbackQueue();
+		virtual ~EventfdCallbackQueue();
+		virtual void addCallback(const ros::CallbackInterfacePtr &callback, uint64_t removal_id = 0);
+		int fd();  // The eventfd to wait for
+		void callPending();  // Clear the eventfd then call the callbacks queued
+
+	// Private part
+	private:
+		int event_fd;
+};
+
+/*!
+ * \brief Priority scheduler between the parser and ExecuteCommand
+ * The commands of a batch are queued by class, then the batch is drained class by
+ * class: safety first, then control, then motion. A PCMD replaces the one waiting,
+ * and a safety command drops the motion and the takeoff waiting before it, so that
+ * they do not run after it.
+ */
+class CommandScheduler {
+
+	// Public part
+	public:
+		CommandScheduler();
+		void push(const struct at_command &command, struct cmd_client &client, struct parser_stats &stats, ExecuteCommand &executeCommand);
+		int drain(struct parser_stats &stats, ExecuteCommand &executeCommand);  // Run the commands waiting, return how many ran
+		void displayStats();
+
+	// Private part
+	private:
+		static command_class classify(const struct at_command &command);
+		void supersede(struct scheduled_command &waiting, command_class cls, struct parser_stats &stats);
+		void execute(struct scheduled_command &waiting, command_class cls, int64_t now, struct parser_stats &stats, ExecuteCommand &executeCommand);
+		int drainClass(command_class cls, struct parser_stats &stats, ExecuteCommand &executeCommand);
+
+		struct scheduled_command queues[CLASS_COUNT][CMD_SCHEDULER_DEPTH];  // Only one slot is used by the motion
+		unsigned int depth[CLASS_COUNT];
+		struct scheduler_class_stats class_stats[CLASS_COUNT];
+		unsigned long batches;
+};
+
 /*!
  * \brief Jakopter commands ros node
  */
@@ -37,38 +367,333 @@ class PikopterCmd {
 
 	// Public part
 	public:
+
+		// Public functions
+		PikopterCmd(char *ip_adress, int batch_size, int max_age_ms, int ping_period_ms, int hover_ms, int land_ms, const char *pilot_ip, int pilot_timeout_ms);  // Constructor
+		~PikopterCmd();  // Destructor
+		bool ready();  // The socket and the event loop were created
+		bool watch(EventfdCallbackQueue &callback_queue);  // Add the fds of the event loop to epoll
+		void run(ExecuteCommand &executeCommand, EventfdCallbackQueue &callback_queue);  // Event loop
+		void stop();  // Make the event loop return, from another thread
+		static bool readParams(ros::NodeHandle &cmd_private_nh, struct cmd_params &params);
+		int receiveBatch();  // Drain the pending datagrams into the packet slots
+		char *packet(int index);  // Get the content of a packet slot
+		int packetLength(int index);  // Get the length of a packet slot
+		int64_t packetReceived(int index);  // Get the kernel reception time of a packet
+		int64_t packetAge(int index);  // Get the time spent by a packet in the socket
+		bool packetTruncated(int index);  // Tell whether a packet did not fit in its slot
+		struct cmd_client &packetClient(int index, int64_t now);  // Get the session of the client which sent a packet
+		void ping(struct cmd_client &client);  // Send a ping to a session
+		void displayBatchStats();  // Display how many packets are drained per wakeup
+		void displayWatchdogStats();  // Display the detection latency of the watchdog
+		void displayStats();  // Display all the counters of the node
+
+		// Public attributes
 		struct sockaddr_in addr_drone_cmd;
-		unsigned char cmd_buffer[PACKET_SIZE];
 		int cmd_fd;
+
+	// Private part
+	private:
+
+		// Event loop
+		void handlePackets(ExecuteCommand &executeCommand);
+		void handleTimer(ExecuteCommand &executeCommand);
+		void checkWatchdog(ExecuteCommand &executeCommand, int64_t now);
+		int64_t nextDeadline();
+		void armTimer(int64_t deadline);
+
+		// Sessions
+		void arbitrate(struct cmd_client &client, int64_t now);
+		void pingSessions(int64_t now);
+		void evictSessions(int64_t now);
+
+		int epoll_fd;
+		int timer_fd;  // Earliest deadline of the ping and of the watchdog
+		int stop_fd;  // Eventfd written by stop()
+		std::atomic<bool> running;
+		int64_t last_received;  // Monotonic time of the last datagram of the pilot (ns)
+		int64_t ping_period;  // ns
+		int64_t max_age;  // ns
+		int64_t clock_offset;  // CLOCK_REALTIME - CLOCK_MONOTONIC at the last batch (ns), 0 before the first one
+		bool clock_stepped;  // The realtime clock stepped since the previous batch, the receive timestamps can't be trusted
+
+		// Link-loss watchdog
+		int64_t watchdog_hover;  // Silence before hovering (ns)
+		int64_t watchdog_land;  // Silence before landing (ns)
+		bool watchdog_armed;  // A client has been heard since the last landing
+		uint8_t link_state;
+		unsigned long watchdog_triggers;
+		int64_t watchdog_latency_max;  // Time between a deadline and its detection (ns)
+		int64_t watchdog_latency_sum;
+
+		// Parser counters, the change detection state is kept by each session
+		struct parser_stats stats;
+
+		// Commands of the batch, run by priority once it is parsed
+		CommandScheduler scheduler;
+
+		// Preallocated packet slots filled by recvmmsg
+		struct mmsghdr batch_msgs[CMD_BATCH_SIZE];
+		struct iovec batch_iovecs[CMD_BATCH_SIZE];
+		struct sockaddr_in batch_addrs[CMD_BATCH_SIZE];
+		unsigned char batch_buffers[CMD_BATCH_SIZE][CMD_DATAGRAM_SIZE + 1];
+		char batch_controls[CMD_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];  // Kernel receive timestamps
+		int batch_size;
+
+		// Sessions of the clients heard on the command channel
+		struct cmd_client clients[CMD_MAX_CLIENTS];
+		struct cmd_client *pilot;  // Session controlling the drone, NULL if none
+		in_addr_t pilot_addr;  // Only this address can pilot, INADDR_ANY for the first client flying
+		int64_t pilot_timeout;  // ns
+		int64_t session_timeout;  // ns
+
+		// Batch statistics
+		unsigned long batch_histogram[CMD_BATCH_SIZE + 1];  // Wakeups by number of packets drained
+		unsigned long batch_wakeups;
+		unsigned long batch_packets;
 };
 
+/*!
+ * \brief Republish the last commanded velocity at a fixed rate
+ * Offboard/guided velocity control expects a continuous setpoint stream.
+ * Incoming commands are coalesced, the latest wins, and the stream stops by
+ * itself when no PCMD has been received for the silence period, unless the
+ * link-loss watchdog holds it.
+ * The turns are measured: delay until a new yaw rate is published, and
+ * steps of the yaw rate and intervals between the setpoints published.
+ */
+class SetpointStreamer {
+	public:
+		SetpointStreamer();
+		~SetpointStreamer();
+		void start(const ros::Publisher &raw_pub, double rate, int silence_ms);
+		void stop();
+		void update(const mavros_msgs::PositionTarget &target);
+		void refresh();
+		void hold(bool held);  // Keep streaming through the silence, while the watchdog owns the drone
+
+	private:
+		void streamLoop();
+
+		ros::Publisher raw_pub;
+		std::chrono::nanoseconds period;
+		std::chrono::milliseconds silence;
+
+		std::thread stream_thread;
+		std::mutex setpoint_mutex;  // Protects all the attributes below
+		std::condition_variable setpoint_changed;
+		bool running;
+		bool pending;  // A new setpoint waits to be published
+		bool streaming;  // False once the silence period is over
+		bool held;  // The silence does not stop the stream
+		mavros_msgs::PositionTarget target;
+		std::chrono::steady_clock::time_point last_command;
+		unsigned long published;
+
+		// Turn statistics
+		bool turn_pending;  // A new yaw rate waits to be published
+		std::chrono::steady_clock::time_point turn_received;  // Reception of the first PCMD changing it
+		unsigned long turns;
+		long turn_latency_sum_us;
+		long turn_latency_max_us;
+		float last_yaw_rate;  // Last yaw rate published (rad/s)
+		float yaw_step_max;  // Largest change of the yaw rate between two setpoints published (rad/s)
+		std::chrono::steady_clock::time_point last_publish;  // Zero when the stream starts
+		long publish_interval_max_us;  // Largest interval between two setpoints of a stream
+};
+
+/*!
+ * \brief Emergency cut-off on its own thread
+ * The receive thread only records the reception time of the datagram and wakes
+ * the thread up, so the force disarm never waits behind the executor or the event
+ * loop. The connection to mavros is opened at start, the first emergency does not pay for it.
+ */
+class EmergencyCutoff {
+	public:
+		EmergencyCutoff();
+		~EmergencyCutoff();
+		bool start(const ros::NodeHandle &node_handle, int fifo_priority);
+		void stop();
+		void trigger(int64_t received);  // From the receive thread, never blocks
+
+	private:
+		void cutoffLoop();
+		void connect();
+		bool forceDisarm(bool retry);
+		bool waitTrigger(int timeout_ms);
+
+		PersistentService<mavros_msgs::CommandLong> command_client;
+		std::thread cutoff_thread;
+		std::atomic<bool> running;
+		int event_fd;  // Written by trigger()
+		std::atomic<int64_t> received;  // Reception of the last emergency (CLOCK_REALTIME ns)
+
+		// Time between the reception of the datagram and the call, only touched by the cut-off thread
+		unsigned long cutoffs;
+		unsigned long retries;  // Force disarms sent again because mavros refused the previous one
+		unsigned long over_bound;  // Cut-offs slower than EMERGENCY_LATENCY_BOUND_US
+		long latency_sum_us;
+		long latency_max_us;
+};
+
+/*!
+ * \brief Upload and execution of a trajectory
+ * The receive thread gathers the chunks of AT*PTRAJ, then a thread paced by an
+ * absolute timerfd feeds the setpoint of the current point to the stream at a
+ * fixed rate, without any round trip with the client. Any other movement command
+ * aborts it: once abort() returns the trajectory never touches the stream again.
+ */
+class TrajectoryRunner {
+	public:
+		TrajectoryRunner();
+		~TrajectoryRunner();
+		bool start(SetpointStreamer *streamer, const ros::Publisher &progress_pub, double rate);
+		void stop();
+		void upload(uint32_t id, uint32_t flags, int32_t first, const char *points, int len);  // From the receive thread
+		void abort(const char *reason);  // From the receive thread
+		bool active();  // A trajectory is running
+
+	private:
+		void runLoop();
+		void tick(uint64_t expirations);
+		void armTimer(int64_t first_ns);
+		bool parsePoints(const char *points, int len);
+		void setpoint(const struct trajectory_point &point, mavros_msgs::PositionTarget &target);
+		void hover();
+		void publishProgress(int64_t now);
+
+		SetpointStreamer *streamer;
+		ros::Publisher progress_pub;
+		int64_t period_ns;
+		std::thread run_thread;
+		std::atomic<bool> running;
+		int timer_fd;  // Armed while a trajectory runs
+
+		// Chunks being uploaded, only touched by the receive thread
+		struct trajectory_point staged[TRAJECTORY_MAX_POINTS];
+		uint32_t staged_id;
+		int staged_count;
+		bool staged_position;
+		bool staged_broken;  // A chunk was missing or invalid, the rest of the upload is ignored
+
+		std::mutex trajectory_mutex;  // Protects all the attributes below, held while feeding the stream
+		struct trajectory_point points[TRAJECTORY_MAX_POINTS];
+		int64_t point_end_ns[TRAJECTORY_MAX_POINTS];  // End of each point from the start
+		int count;
+		bool position;
+		uint32_t id;
+		uint8_t state;  // TRAJECTORY_*
+		int current;  // Point being executed
+		int64_t start_ns;  // Monotonic time of the start
+		int64_t elapsed_ns;
+		int64_t last_progress_ns;
+		uint64_t tick_index;  // Timer expirations since the start
+
+		// Execution statistics
+		unsigned long started;
+		unsigned long completed;
+		unsigned long aborted;
+		unsigned long ticks;
+		long tick_late_max_us;  // Largest delay between a tick deadline and its setpoint
+};
+
+/*!
+ * \brief Mavros commands
+ * Long operations (takeoff, land) are handed to a dedicated executor thread
+ * so that they never block the receive loop.
+ */
 class ExecuteCommand {
 	public:
-		ExecuteCommand();
+		ExecuteCommand(const ros::NodeHandle &node_handle, const ros::NodeHandle &private_nh, ros::CallbackQueueInterface *callback_queue = NULL);
+		~ExecuteCommand();
+		bool ready();  // The emergency cut-off and the trajectories are running
 		bool takeoff();
 		bool land();
-		void forward(int accel);
-		void backward(int accel);
-		void down(int accel);
-		void up(int accel);
-		void left(int accel);
-		void right(int accel);
-		void slide_left(int accel);
-		void slide_right(int accel);
-		float convertSpeedARDroneToRate(int speed);
+		void move(int roll, int pitch, int gaz, int yaw);
+		void stay();
+		void watchdogHover();
+		void keepAlive();
+		void linkState(uint8_t state);
+		void navdataDemo(bool demo);
+		void emergency(int64_t received);
+		void uploadTrajectory(uint32_t id, uint32_t flags, int32_t first, const struct at_arg &points);
+		float convertSpeedARDroneToRate(int speed) const;
+		static float decodeStick(int speed, float deadband, float deadband_scale, float expo);
 		void cmd_received();
+		void handleState(const mavros_msgs::State::ConstPtr& msg);
 
 	private:
-		ros::ServiceClient arming_client;
-		ros::ServiceClient set_mode_client;
-		ros::ServiceClient takeoff_client;
-		ros::ServiceClient land_client;
-		ros::ServiceClient command_long_client;
-		ros::Publisher velocity_pub;
+		// Executor thread
+		void waitForMavros();
+		bool queueOperation(executor_op op);
+		void executorLoop();
+		void startOperation(executor_op op);
+		void stepOperation();
+		void setStage(executor_stage stage);
+		void finishOperation(bool success, const char *reason);
+		bool stageTimedOut();
+
+		SpscQueue<executor_op, EXECUTOR_QUEUE_SIZE> executor_queue;
+		std::atomic<bool> emergency_queued;  // The abort of an emergency waits in the queue, the repeats don't fill it
+		std::thread executor_thread;
+		std::atomic<bool> executor_running;
+		std::mutex executor_wakeup_mutex;
+		std::condition_variable executor_wakeup;
+		executor_op current_op;
+		executor_stage current_stage;
+		std::chrono::steady_clock::time_point op_start;
+		std::chrono::steady_clock::time_point stage_start;
+
+		// Last state published by mavros
+		std::atomic<bool> fcu_connected;
+		std::atomic<bool> fcu_armed;
+		std::atomic<bool> fcu_guided;
+
+		ros::Subscriber state_sub;
+		ros::Publisher executor_status_pub;
+		ros::Publisher link_state_pub;
+		ros::Publisher navdata_demo_pub;
+		ros::Publisher trajectory_pub;
+
+		// Connections to mavros kept between the operations
+		PersistentService<mavros_msgs::CommandBool> arming_client;
+		PersistentService<mavros_msgs::SetMode> set_mode_client;
+		PersistentService<mavros_msgs::CommandTOL> takeoff_client;
+		PersistentService<mavros_msgs::CommandTOL> land_client;
 		ros::Publisher setpoint_raw_pub;
 		ros::Publisher navdatas;
-		geometry_msgs::TwistStamped msgMove;
 		mavros_msgs::PositionTarget msgPosRawPub;
+		SetpointStreamer streamer;
+		EmergencyCutoff cutoff;
+		TrajectoryRunner trajectory_runner;  // Declared after the streamer it feeds
+		bool threads_started;  // The cut-off and the trajectory threads are running
+
+		// Shaping of the stick values
+		float stick_deadband;
+		float stick_deadband_scale;  // 1 / (1 - stick_deadband)
+		float stick_expo;
 };
 
+// Handler of a verb in the dispatch table
+typedef void (*at_handler)(const struct at_command &command, struct parser_state &state, ExecuteCommand &executeCommand);
+
+// Entry of the dispatch table, keyed on the verb
+struct at_dispatch_entry {
+	const char *name;  // Verb as written after AT*
+	uint8_t len;  // Length of the verb
+	at_verb verb;
+	int nargs;  // Minimum number of arguments after the sequence number
+	at_handler handler;  // NULL if the command is accepted but ignored
+};
+
+const char *tokenizeCommand(const char *buf, const char *end, struct at_command &command);
+bool dispatchCommand(const struct at_command &command, struct parser_state &state, ExecuteCommand &executeCommand);
+bool acceptSequence(struct cmd_client &client, const struct at_command &command, struct parser_stats &stats);
+bool observerAllowed(const struct at_command &command);
+bool takesControl(const struct at_command &command);
+bool isEmergency(const struct at_command &command);
+bool containsEmergency(const char *buf, int len);
+int parseCommand(const char *buf, int len, int64_t received, struct cmd_client &client, struct parser_stats &stats, CommandScheduler &scheduler, ExecuteCommand &executeCommand);
+void displayParserStats(const struct parser_stats &stats);
+
 #endif
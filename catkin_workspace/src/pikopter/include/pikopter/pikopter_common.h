@@ -16,6 +16,9 @@
 #include "netdb.h"
 #include "sstream"
 #include "mutex"
+#include "atomic"
+#include "chrono"
+#include "vector"
 #include "arpa/inet.h"
 #include "netinet/in.h"
 #include "sys/socket.h"
@@ -62,6 +65,27 @@
 // Time to sleep if mavros isn't launched yet
 #define MAVROS_WAIT_TIMEOUT 10000  // In ms
 
+// State of the command link published by the cmd node on pikopter_cmd/link_state
+#define LINK_STATE_OK 0  // Commands received
+#define LINK_STATE_WATCHDOG 1  // Silence, the drone hovers
+#define LINK_STATE_LOST 2  // Long silence, the drone lands
+
+// State of the uploaded trajectory published by the cmd node on pikopter_cmd/trajectory
+#define TRAJECTORY_IDLE 0  // Nothing uploaded yet
+#define TRAJECTORY_RUNNING 1  // Executed by the cmd node
+#define TRAJECTORY_DONE 2  // Last point reached
+#define TRAJECTORY_ABORTED 3  // Stopped by a command or an emergency
+#define TRAJECTORY_REJECTED 4  // Upload with a missing chunk or an invalid point, not executed
+
+// Fields of the pikopter_cmd/trajectory message
+#define TRAJECTORY_FIELD_ID 0
+#define TRAJECTORY_FIELD_STATE 1
+#define TRAJECTORY_FIELD_POINT 2  // Point being executed
+#define TRAJECTORY_FIELD_POINTS 3  // Number of points
+#define TRAJECTORY_FIELD_ELAPSED_MS 4
+#define TRAJECTORY_FIELD_DURATION_MS 5
+#define TRAJECTORY_FIELDS 6
+
 
 
 /* ################################### Classes ################################### */
@@ -73,6 +97,224 @@ class PikopterNetwork {
 	// Public methods
 	public:
 		static int open_udp_socket(int portnum, struct sockaddr_in *serv_addr, char *station_ip);
+		static int bind_udp_socket(int fd, int portnum);
+		static int wait_for_services(const std::vector<std::string> &services, int timeout_ms);
+};
+
+
+/*!
+ * \brief Persistent client of a ROS service, opened again when its connection is lost
+ * The connection is kept between the calls instead of being made for each of them.
+ * The calls are serialized and the latency of each of them is reported.
+ */
+template <typename S>
+class PersistentService {
+
+	// Public methods
+	public:
+		PersistentService() : calls(0), failures(0), reconnections(0), latency_sum_us(0), latency_max_us(0) {}
+
+		// The connection itself is made by the first call
+		void init(const ros::NodeHandle &node_handle, const std::string &service_name) {
+			std::lock_guard<std::mutex> lock(call_mutex);
+			nh = node_handle;
+			name = service_name;
+			client = nh.serviceClient<S>(name, true);
+		}
+
+		// False if the service could not be called, even after a reconnection
+		bool call(S &srv) {
+			std::lock_guard<std::mutex> lock(call_mutex);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			// A persistent client stays invalid once its connection is closed (mavros restarted), open a new one
+			bool ok = client.call(srv);
+			if (!ok && !client.isValid()) {
+				client = nh.serviceClient<S>(name, true);
+				reconnections++;
+				ok = client.call(srv);
+			}
+
+			long latency_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			calls++;
+			latency_sum_us += latency_us;
+			if (latency_us > latency_max_us) latency_max_us = latency_us;
+			if (ok) ROS_DEBUG("Service %s answered in %ldus", name.c_str(), latency_us);
+			else {
+				failures++;
+				ROS_ERROR("Service %s failed after %ldus", name.c_str(), latency_us);
+			}
+			return ok;
+		}
+
+		void displayStats() {
+			std::lock_guard<std::mutex> lock(call_mutex);
+			if (calls == 0) return;
+			ROS_INFO("Service %s: %lu calls, %lu failed, %lu reconnections, latency mean %ldus max %ldus",
+				name.c_str(), calls, failures, reconnections, latency_sum_us / (long)calls, latency_max_us);
+		}
+
+	// Private attributes
+	private:
+		ros::NodeHandle nh;
+		std::string name;
+		ros::ServiceClient client;
+		std::mutex call_mutex;  // A persistent connection carries one call at a time
+
+		// Statistics of the calls
+		unsigned long calls;
+		unsigned long failures;
+		unsigned long reconnections;
+		long latency_sum_us;
+		long latency_max_us;
+};
+
+
+/*!
+ * \brief Lock-free queue with a single producer thread and a single consumer thread
+ *
+ * \remark One slot is kept empty to tell a full queue from an empty one,
+ *         so the queue holds at most N - 1 items
+ */
+template <typename T, unsigned int N>
+class SpscQueue {
+
+	// Public methods
+	public:
+		SpscQueue() : head(0), tail(0) {}
+
+		// Called by the producer only, false if the queue is full
+		bool push(const T &item) {
+			unsigned int t = tail.load(std::memory_order_relaxed);
+			unsigned int next = (t + 1) % N;
+			if (next == head.load(std::memory_order_acquire)) return false;
+			items[t] = item;
+			tail.store(next, std::memory_order_release);
+			return true;
+		}
+
+		// Called by the consumer only, false if the queue is empty
+		bool pop(T &item) {
+			unsigned int h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) return false;
+			item = items[h];
+			head.store((h + 1) % N, std::memory_order_release);
+			return true;
+		}
+
+		// Number of items waiting, approximative if called while the other side works
+		unsigned int size() const {
+			unsigned int h = head.load(std::memory_order_acquire);
+			unsigned int t = tail.load(std::memory_order_acquire);
+			return (t + N - h) % N;
+		}
+
+	// Private attributes
+	private:
+		T items[N];
+		std::atomic<unsigned int> head;  // Next item to pop, written by the consumer
+		std::atomic<unsigned int> tail;  // Next free slot, written by the producer
+};
+
+
+/*!
+ * \brief Sequence lock around a plain value
+ * Writers are serialized among themselves but never wait for the readers,
+ * and readers never block: they copy the value again if a write happened meanwhile.
+ * The sequence is odd while a write is in progress.
+ *
+ * \remark T must be trivially copyable, readers get it with one memcpy
+ */
+template <typename T>
+class Seqlock {
+
+	// Public methods
+	public:
+		Seqlock() : sequence(0) {}
+
+		// Apply update(T &) to the value, readers will see all the changes or none of them
+		template <typename F>
+		void write(F update) {
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			unsigned int s = sequence.load(std::memory_order_relaxed);
+			sequence.store(s + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			update(value);
+			sequence.store(s + 2, std::memory_order_release);
+		}
+
+		// Get a consistent copy of the value
+		void read(T &snapshot) const {
+			unsigned int before, after;
+			do {
+				before = sequence.load(std::memory_order_acquire);
+				memcpy(&snapshot, &value, sizeof(T));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				after = sequence.load(std::memory_order_relaxed);
+			} while ((before & 1) || before != after);
+		}
+
+	// Private attributes
+	private:
+		T value;
+		std::atomic<unsigned int> sequence;
+		std::mutex writer_mutex;  // Serializes the writers only
+};
+
+/*!
+ * \brief Direct path of the command acknowledgment between the cmd and navdata nodelets
+ * When both are loaded in the same process, the navdata attaches its handler and the
+ * cmd side calls it instead of publishing on pikopter_cmd/cmd_received: the handler
+ * only raises an atomic flag, nothing is serialized nor queued.
+ * The standalone nodes never attach, so the topic stays used between processes.
+ */
+class CommandAckLink {
+
+	// Public methods
+	public:
+		typedef void (*ack_handler)(void *target);
+
+		// Called by the navdata when it is loaded in the process
+		static void attach(ack_handler handler, void *target) {
+			CommandAckLink &link = process();
+			std::lock_guard<std::mutex> lock(link.link_mutex);
+			link.handler = handler;
+			link.target = target;
+		}
+
+		// Called by the navdata before it is destroyed, the handler is not running anymore on return
+		static void detach(void *target) {
+			CommandAckLink &link = process();
+			std::lock_guard<std::mutex> lock(link.link_mutex);
+			if (link.target != target) return;
+			link.handler = NULL;
+			link.target = NULL;
+		}
+
+		// Called by the cmd side, false if no navdata is attached and the acknowledgment must be published
+		static bool signal() {
+			CommandAckLink &link = process();
+			std::lock_guard<std::mutex> lock(link.link_mutex);
+			if (link.handler == NULL) return false;
+			link.handler(link.target);
+			return true;
+		}
+
+	// Private methods
+	private:
+		CommandAckLink() : handler(NULL), target(NULL) {}
+
+		// One link per process, shared by all the nodelets of the library
+		static CommandAckLink &process() {
+			static CommandAckLink link;
+			return link;
+		}
+
+	// Private attributes
+	private:
+		ack_handler handler;
+		void *target;
+		std::mutex link_mutex;  // Never contended but on load and unload
 };
 
 #endif
@@ -8,15 +8,40 @@
 
 // Mavros structures includes for the subscribers
 #include "std_msgs/Float64.h"
+#include "std_msgs/UInt8.h"
+#include "std_msgs/UInt32MultiArray.h"
 #include "mavros_msgs/BatteryStatus.h"
 #include "geometry_msgs/TwistStamped.h"
 #include "mavros_msgs/ExtendedState.h"
 #include "mavros_msgs/State.h"
 #include "geometry_msgs/PoseStamped.h"
+#include "sensor_msgs/Imu.h"
+#include "sensor_msgs/NavSatFix.h"
 
 // Mavros structures includes for the services used
 #include "mavros_msgs/StreamRate.h"
 
+// For the conversions of the full mode
+#include <cmath>
+
+// For the layout checks of the wire format
+#include <cstddef>
+
+// Sender thread includes
+#include "thread"
+#include "sys/timerfd.h"
+#include "sys/eventfd.h"
+#include "sys/epoll.h"
+
+// Congestion of the navdata socket
+#include "sys/ioctl.h"
+#include "linux/sockios.h"
+#include <algorithm>
+
+// Shared messages, not serialized between the nodelets of a process
+#include "vector"
+#include "boost/make_shared.hpp"
+
 
 
 
@@ -29,8 +54,17 @@
 // A tag to say if it's a demo or not
 #define TAG_DEMO 0
 
+// Tags of the option blocks in full mode (SDK navdata_common.h)
+#define TAG_TIME 1
+#define TAG_RAW_MEASURES 2
+#define TAG_ALTITUDE 10
+#define TAG_GPS 27
+
+// Tag of the trajectory option, a pikopter extension above the tags of the SDK
+#define TAG_TRAJECTORY 0x1000
+
 // Tag for the checksum packet in full mode
-#define TAG_CKS 0
+#define TAG_CKS 0xFFFF
 #define NAVDATA_NREADS_INT 4
 #define NAVDATA_NREADS_FLOAT 6
 
@@ -45,8 +79,10 @@
 /* ##### Specific to navdata ros parameters ##### */
 // For the stream rate requests
 #define SR_REQUEST_ON (uint8_t)1
+#define SR_REQUEST_OFF (uint8_t)0
 #define SR_REQUEST_EXTENDED_STATE_RATE (uint16_t)1
 #define SR_REQUEST_POSITION_RATE (uint16_t)200
+#define SR_REQUEST_RAW_SENSORS_RATE (uint16_t)200  // Only in full mode
 
 // Loop rate in hertz
 // For ArDrone, in demo mode it's 15Hz and in normal mode it's 200Hz
@@ -62,6 +98,67 @@
 #define SUB_BUF_SIZE_EXTENDED_STATE 10
 #define SUB_BUF_SIZE_STATE 10
 #define SUB_BUF_SIZE_CMD_RECEIVED 100
+#define SUB_BUF_SIZE_LINK_STATE 10
+#define SUB_BUF_SIZE_IMU_RAW 10
+#define SUB_BUF_SIZE_GPS 10
+#define SUB_BUF_SIZE_NAVDATA_DEMO 1
+#define SUB_BUF_SIZE_TRAJECTORY 10
+
+// Publishers' buffer size
+#define PUB_BUF_SIZE_SEND_JITTER 1
+#define PUB_BUF_SIZE_EFFECTIVE_RATE 1
+
+
+/* ##### Specific to the sender thread ##### */
+// Number of threads running the subscribers' callbacks
+#define NAVDATA_SPINNER_THREADS 2
+
+// SCHED_FIFO priority of the sender thread (0 keeps the default policy)
+#define NAVDATA_SENDER_FIFO_PRIORITY 0
+
+// Histogram of the deviation between two sends and the period, one bin per 100us
+// The last bin counts everything above
+#define NAVDATA_JITTER_BINS 16
+#define NAVDATA_JITTER_BIN_US 100
+
+// Number of packets between two publications of the jitter histogram
+#define NAVDATA_JITTER_PUBLISH_PERIOD 150
+
+// Events the sender waits for: the periodic timer, the push requests, the deferred push and the wake-ups
+#define NAVDATA_EPOLL_EVENTS 4
+
+// Minimum time between two packets sent out of the periodic stream
+#define NAVDATA_PUSH_MIN_SPACING_MS 5
+
+
+/* ##### Specific to the clients ##### */
+// Clients receiving the navdata at the same time, the station given by the ip parameter included
+#define NAVDATA_MAX_CLIENTS 8
+
+// A client is forgotten when its wake-up has not been repeated for this long (0 to keep them)
+#define NAVDATA_CLIENT_TIMEOUT_MS 10000
+
+// Wake-ups are a few bytes, the second one is an optional rate divisor
+#define NAVDATA_WAKEUP_SIZE 16
+
+
+/* ##### Specific to the congestion control ##### */
+// Bytes waiting in the socket above which the link is considered congested
+#define NAVDATA_OUTQ_HIGH_BYTES 4096
+
+// The rate is multiplied by this factor on congestion, at most once per holdoff
+#define NAVDATA_BACKOFF_FACTOR 0.5
+#define NAVDATA_BACKOFF_HOLDOFF_MS 200
+
+// Lowest fraction of the nominal rate
+#define NAVDATA_MIN_RATE_SCALE 0.1
+
+// The rate goes back up by one step per period without congestion
+#define NAVDATA_RECOVERY_STEP 0.1
+#define NAVDATA_RECOVERY_PERIOD_MS 500
+
+// Under this fraction of the nominal rate, the raw measures and gps options are not sent
+#define NAVDATA_DROP_OPTIONS_SCALE 0.5
 
 
 /* ##### Specific to navdata (new constants) ##### */
@@ -84,6 +181,25 @@
 #define DEFAULT_NAVDATA_DEMO_ARDRONE_STATE 0x400  // 1024 because only the 11th bit is at 1
 #define DEFAULT_NAVDATA_ARDRONE_STATE 0  // All the bits to 0
 
+/* ##### Specific to the wire format ##### */
+// Room for the header and all the option blocks of a packet
+#define NAVDATA_MAX_PACKET_SIZE 1024
+
+// Conversions of the mavros raw imu into the raw measures option
+#define NAVDATA_RAW_ACC_SCALE (1000.0 / 9.80665)  // m/s^2 to milli-g
+#define NAVDATA_RAW_GYRO_SCALE (180.0 / M_PI)  // rad/s to deg/s
+
+// Bits of the ardrone_state mask pushed to the client as soon as they change
+#define ARDRONE_FLY_MASK (1U << 0)  // The drone is flying
+#define ARDRONE_VBAT_LOW_MASK 0x4000  // Critical battery, value used by our clients
+
+// Bits of the ardrone_state mask for the command link (SDK config.h)
+#define ARDRONE_COM_LOST_MASK (1U << 13)  // Communication lost, the drone lands
+#define ARDRONE_COM_WATCHDOG_MASK (1U << 30)  // Communication watchdog triggered
+
+// Bits of the ardrone_state mask whose changes are pushed, the others wait for the periodic packet
+#define NAVDATA_PUSH_STATE_MASK (ARDRONE_FLY_MASK | ARDRONE_VBAT_LOW_MASK | ARDRONE_COM_LOST_MASK)
+
 
 
 
@@ -218,6 +334,181 @@ union navdata_t {
 };
 
 
+/* ########## Wire format ########## */
+// Every block starts with its tag and its size, as sent on the wire
+// The blocks are copied as is, so the layout is checked below
+
+// Header of a full mode packet
+struct navdata_header {
+	uint32_t   header;  // Always 88776655
+	uint32_t   ardrone_state;  // Bit mask defined in SDK config.h
+	uint32_t   sequence;  // Sequence number of the packet
+	uint32_t   vision_defined;  // True: vision computed by ardrone onboard chip
+} __attribute__((packed));
+
+// Demo option, the same datas as in demo mode
+struct navdata_demo_option {
+	uint16_t   tag;  // TAG_DEMO
+	uint16_t   size;
+	uint32_t   ctrl_state;
+	uint32_t   vbat_flying_percentage;
+	float32_t  theta;
+	float32_t  phi;
+	float32_t  psi;
+	int32_t    altitude;
+	float32_t  vx;
+	float32_t  vy;
+	float32_t  vz;
+	uint32_t   num_frames;
+	float32_t  detection_camera_rot[9];
+	float32_t  detection_camera_trans[3];
+	uint32_t   detection_tag_index;
+	uint32_t   detection_camera_type;
+	float32_t  drone_camera_rot[9];
+	float32_t  drone_camera_trans[3];
+} __attribute__((packed));
+
+// Time option: 11 bits of seconds then 21 bits of microseconds since the start
+struct navdata_time_option {
+	uint16_t   tag;  // TAG_TIME
+	uint16_t   size;
+	uint32_t   time;
+} __attribute__((packed));
+
+// Raw measures option, filled from the mavros raw imu (scaled, not ADC counts)
+struct navdata_raw_measures_option {
+	uint16_t   tag;  // TAG_RAW_MEASURES
+	uint16_t   size;
+	uint16_t   raw_accs[3];  // Accelerations in milli-g
+	int16_t    raw_gyros[3];  // Angular rates in deg/s
+	int16_t    raw_gyros_110[2];
+	uint32_t   vbat_raw;  // Battery voltage in mV
+	uint16_t   us_debut_echo;
+	uint16_t   us_fin_echo;
+	uint16_t   us_association_echo;
+	uint16_t   us_distance_echo;
+	uint16_t   us_courbe_temps;
+	uint16_t   us_courbe_valeur;
+	uint16_t   us_courbe_ref;
+	uint16_t   flag_echo_ini;
+	uint16_t   nb_echo;
+	uint32_t   sum_echo;
+	int32_t    alt_temp_raw;
+	int16_t    gradient;
+} __attribute__((packed));
+
+// Altitude option
+struct navdata_altitude_option {
+	uint16_t   tag;  // TAG_ALTITUDE
+	uint16_t   size;
+	int32_t    altitude_vision;
+	float32_t  altitude_vz;
+	int32_t    altitude_ref;
+	int32_t    altitude_raw;
+	float32_t  obs_acc_z;
+	float32_t  obs_alt;
+	float32_t  obs_x[3];
+	uint32_t   obs_state;
+	float32_t  est_vb[2];
+	uint32_t   est_state;
+} __attribute__((packed));
+
+// GPS option, only the leading fields of the SDK block
+struct navdata_gps_option {
+	uint16_t   tag;  // TAG_GPS
+	uint16_t   size;
+	float64_t  latitude;
+	float64_t  longitude;
+	float64_t  elevation;
+	float64_t  hdop;
+	uint32_t   data_available;
+	uint32_t   zero_validated;
+	uint32_t   wpt_validated;
+	float64_t  lat0;
+	float64_t  lon0;
+	float64_t  lat_fuse;
+	float64_t  lon_fuse;
+	uint32_t   gps_state;
+} __attribute__((packed));
+
+// Trajectory option, progress of the trajectory uploaded with AT*PTRAJ
+struct navdata_trajectory_option {
+	uint16_t   tag;  // TAG_TRAJECTORY
+	uint16_t   size;
+	uint32_t   id;
+	uint32_t   state;  // TRAJECTORY_*
+	uint32_t   point;  // Point being executed
+	uint32_t   points;  // Number of points
+	uint32_t   elapsed_ms;
+	uint32_t   duration_ms;
+} __attribute__((packed));
+
+// Checksum option, always the last one
+struct navdata_cks_option {
+	uint16_t   tag;  // TAG_CKS
+	uint16_t   size;
+	uint32_t   cks;  // Sum of all the bytes before this block
+} __attribute__((packed));
+
+// Layout of the wire format (SDK navdata_common.h), the blocks are copied with memcpy
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "The navdata blocks are copied as little-endian");
+static_assert(sizeof(float32_t) == 4 && sizeof(float64_t) == 8, "IEEE floats are expected on the wire");
+static_assert(sizeof(struct navdata_header) == 16, "Navdata header must be 16 bytes");
+static_assert(offsetof(struct navdata_header, vision_defined) == 12, "vision_defined is a 32 bits field");
+static_assert(sizeof(struct navdata_demo_option) == 148, "Demo option must be 148 bytes");
+static_assert(offsetof(struct navdata_demo_option, altitude) == 24, "Wrong demo option layout");
+static_assert(offsetof(struct navdata_demo_option, num_frames) == 40, "Wrong demo option layout");
+static_assert(offsetof(struct navdata_demo_option, drone_camera_trans) == 136, "Wrong demo option layout");
+static_assert(sizeof(struct navdata_time_option) == 8, "Time option must be 8 bytes");
+static_assert(sizeof(struct navdata_raw_measures_option) == 52, "Raw measures option must be 52 bytes");
+static_assert(offsetof(struct navdata_raw_measures_option, vbat_raw) == 20, "Wrong raw measures option layout");
+static_assert(offsetof(struct navdata_raw_measures_option, sum_echo) == 42, "Wrong raw measures option layout");
+static_assert(sizeof(struct navdata_altitude_option) == 56, "Altitude option must be 56 bytes");
+static_assert(offsetof(struct navdata_altitude_option, obs_state) == 40, "Wrong altitude option layout");
+static_assert(sizeof(struct navdata_gps_option) == 84, "Gps option must be 84 bytes");
+static_assert(offsetof(struct navdata_gps_option, data_available) == 36, "Wrong gps option layout");
+static_assert(sizeof(struct navdata_trajectory_option) == 28, "Trajectory option must be 28 bytes");
+static_assert(sizeof(struct navdata_cks_option) == 8, "Checksum option must be 8 bytes");
+static_assert(sizeof(struct navdata_header) + sizeof(struct navdata_demo_option) + sizeof(struct navdata_time_option)
+		+ sizeof(struct navdata_raw_measures_option) + sizeof(struct navdata_altitude_option)
+		+ sizeof(struct navdata_gps_option) + sizeof(struct navdata_trajectory_option)
+		+ sizeof(struct navdata_cks_option) <= NAVDATA_MAX_PACKET_SIZE,
+		"The send buffer must hold every option");
+
+// A client of the navdata, registered by its wake-up datagram
+struct navdata_client {
+	struct sockaddr_in addr;
+	bool       active;
+	bool       permanent;  // The station given by the ip parameter, never evicted
+	uint32_t   divisor;  // The client gets one periodic packet out of divisor
+	uint64_t   last_seen_ns;  // Last wake-up received
+	bool       ack_owed;  // A command was acknowledged since the last packet sent to this client
+};
+
+// Sensors only sent in full mode, written by the callbacks
+struct navdata_sensors {
+	bool       imu_defined;  // A raw imu message has been received
+	float64_t  acc[3];  // m/s^2
+	float64_t  gyro[3];  // rad/s
+	bool       gps_defined;  // A gps fix has been received
+	float64_t  latitude;
+	float64_t  longitude;
+	float64_t  elevation;
+	uint32_t   vbat_raw;  // mV
+};
+
+// Parameters of the node, read from its private namespace
+struct navdata_params {
+	std::string ip;  // The station, always a client
+	bool       demo_mode;  // Demo mode at start
+	int        fifo_priority;  // SCHED_FIFO priority of the sender, 0 for the default policy
+	bool       event_push;  // Push packets at once on important changes
+	int        push_spacing_ms;
+	int        client_timeout_ms;
+	int        spinner_threads;  // Standalone node only, the nodelet uses the threads of its manager
+};
+
+
 
 /* ################################### Classes ################################### */
 /*!
@@ -229,11 +520,17 @@ class PikopterNavdata {
 	public:
 
 		// Public functions
-		PikopterNavdata(char *ip_adress, bool in_demo);  // Constructor
+		PikopterNavdata(char *ip_adress, bool in_demo, ros::NodeHandle &node_handle);  // Constructor
 		~PikopterNavdata();  // Destructor
-		void sendNavdata();  // Send the navdata
+		bool sendNavdata(bool periodic);  // Send the navdata to the clients, true if the link is congested
 		void display();  // Display the current method of the navdata
 		void setBitEndOfBootstrap();
+		bool startSender(int rate, int fifo_priority, bool event_push, int push_spacing_ms, int client_timeout_ms);  // Start the thread sending the navdata
+		void stopSender();  // Stop and join the sender thread
+		void subscribe(ros::NodeHandle &node_handle);  // Subscribe the handlers to mavros and to the cmd node
+		void acknowledgeCommand();  // Put the acknowledgment bit in the next packet, sent at once
+		static void ackHandler(void *navdata);  // Handler of the CommandAckLink
+		static bool readParams(ros::NodeHandle &private_node_handle, struct navdata_params &params);
 
 		// Handlers
 		void getAltitude(const std_msgs::Float64::ConstPtr& msg);
@@ -242,9 +539,15 @@ class PikopterNavdata {
 		void getExtendedState(const mavros_msgs::ExtendedState::ConstPtr& msg);
 		void getState(const mavros_msgs::State::ConstPtr& msg);
 		void handleOrientation(const geometry_msgs::PoseStamped::ConstPtr& msg);
-		void handleCmdReceived(const std_msgs::Bool status);
+		void handleCmdReceived(const std_msgs::Bool::ConstPtr& status);
+		void handleLinkState(const std_msgs::UInt8::ConstPtr& msg);
+		void handleImuRaw(const sensor_msgs::Imu::ConstPtr& msg);
+		void handleGps(const sensor_msgs::NavSatFix::ConstPtr& msg);
+		void handleNavdataDemo(const std_msgs::Bool::ConstPtr& msg);
+		void handleTrajectory(const std_msgs::UInt32MultiArray::ConstPtr& msg);
 
 		// Accessors
+		bool isReady();
 		bool inDemoMode();
 
 	// Private part
@@ -253,14 +556,92 @@ class PikopterNavdata {
 		// Private functions
 		void initNavdata();
 		void askMavrosRate();
+		void askMavrosRawSensors(bool on);
 		void incrementSequenceNumber();
+		size_t serializePacket(const union navdata_t &navdata, bool full);  // Write the packet into send_buffer
+		size_t serializeFullOptions(const union navdata_t &navdata, size_t offset);
+		void senderLoop();  // Body of the sender thread
+		bool armTimer(int64_t period_ns);
+		void requestPush(bool critical);  // Ask the sender for a packet out of the periodic stream
+		void adaptRate(bool congested, uint64_t now_ns);
+		void receiveWakeups(uint64_t now_ns);  // Register the clients asking for the navdata
+		void registerClient(const struct sockaddr_in &addr, uint32_t divisor, bool permanent, uint64_t now_ns);
+		void evictClients(uint64_t now_ns);
+		void displayAckLatency();
+		void recordJitter(uint64_t now_ns, uint64_t expirations);
+		void publishJitter();
 
 		// Private attributes
 		struct sockaddr_in addr_drone_navdata;
-		union navdata_t navdata_current;
+		Seqlock<union navdata_t> navdata_current;  // Written by the callbacks, read by the sender
+		uint32_t navdata_sequence;  // Sequence number, owned by the sender
+		std::atomic<uint64_t> cmd_ack_requested_ns;  // Reception of the oldest unacknowledged command, 0 if none
+		std::atomic<bool> ack_bit_sent;  // The last packet carried the acknowledgment bit
 		int navdata_fd;
-		bool demo_mode;
-		std::mutex navdata_mutex;
+		std::atomic<bool> demo_mode;  // Switched by the callbacks, read by the sender
+
+		// Stream rates of mavros, asked by the setup thread then by the mode switches
+		PersistentService<mavros_msgs::StreamRate> stream_rate_client;
+		std::thread setup_thread;
+
+		// Full mode
+		Seqlock<struct navdata_sensors> sensors_current;  // Written by the callbacks, read by the sender
+
+		// Trajectory run by the cmd node, sent in both modes once one has been uploaded
+		Seqlock<struct navdata_trajectory_option> trajectory_current;  // Written by the callback, read by the sender
+		uint8_t send_buffer[NAVDATA_MAX_PACKET_SIZE];  // Only used by the sender
+		uint64_t start_time_ns;  // Origin of the time option
+
+		// Sender thread, paced by an absolute timerfd
+		std::thread sender_thread;
+		std::atomic<bool> sender_running;
+		int timer_fd;
+		int64_t send_period_ns;  // Period the timer is armed on
+		std::atomic<int64_t> requested_period_ns;  // Period of the current mode
+		uint64_t last_send_ns;  // Last periodic send, 0 before the first one
+
+		// Packets pushed out of the periodic stream on important changes
+		std::atomic<bool> push_enabled;
+		int push_fd;  // Eventfd written by the callbacks
+		int push_timer_fd;  // Deferred push, to keep the minimum spacing
+		int epoll_fd;
+		bool push_pending;
+		std::atomic<bool> push_critical;  // A pushed state bit changed, pushed even under congestion
+		bool push_critical_pending;
+		uint64_t push_spacing_ns;
+		uint64_t last_packet_ns;  // Last packet sent, periodic or pushed
+		uint32_t pushed_packets;
+		uint32_t coalesced_pushes;  // Pushes left to the periodic packet because of the congestion
+
+		// Clients, only touched by the sender thread once it is started
+		struct navdata_client clients[NAVDATA_MAX_CLIENTS];
+		bool listening;  // The socket is bound and receives the wake-ups
+		uint64_t client_timeout_ns;
+		uint32_t periodic_ticks;  // For the rate divisors of the clients
+		struct mmsghdr fanout_msgs[NAVDATA_MAX_CLIENTS];
+		struct iovec fanout_iovec;
+
+		// Congestion control, only touched by the sender thread
+		double rate_scale;  // Fraction of the nominal rate of the mode
+		bool drop_low_priority;  // Leave the raw measures and gps options out
+		uint64_t last_rate_change_ns;
+		uint64_t last_congestion_ns;
+		uint32_t congestion_drops;  // Packets refused by the socket
+		ros::Publisher effective_rate_pub;
+
+		// Latency between a command and the packet acknowledging it
+		uint32_t ack_count;
+		uint64_t ack_latency_sum_ns;
+		uint64_t ack_latency_max_ns;
+
+		// Jitter of the send intervals, only touched by the sender thread
+		uint32_t jitter_histogram[NAVDATA_JITTER_BINS];
+		uint32_t jitter_missed;  // Timer expirations that were not served in time
+		int64_t jitter_max_ns;
+		ros::Publisher jitter_pub;
+
+		// Subscribers of the handlers, kept for the lifetime of the object
+		std::vector<ros::Subscriber> subscribers;
 };
 
 #endif
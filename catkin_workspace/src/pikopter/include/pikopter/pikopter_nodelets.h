@@ -0,0 +1,61 @@
+#ifndef PIKOPTER_NODELETS_H
+#define PIKOPTER_NODELETS_H
+
+
+/* ################################### INCLUDES ################################### */
+// The nodes wrapped by the nodelets
+#include "pikopter_cmd.h"
+#include "pikopter_navdata.h"
+
+// Nodelet librairies
+#include "nodelet/nodelet.h"
+#include "memory"
+
+
+
+/* ################################### Classes ################################### */
+namespace pikopter {
+
+/*!
+ * \brief The cmd node loaded in a nodelet manager
+ * The event loop keeps its own thread and callback queue, as in the standalone node.
+ */
+class CmdNodelet : public nodelet::Nodelet {
+
+	// Public part
+	public:
+		CmdNodelet();
+		virtual ~CmdNodelet();
+
+	// Private part
+	private:
+		virtual void onInit();
+
+		EventfdCallbackQueue callback_queue;  // Declared first, the subscriptions of executeCommand use it
+		std::unique_ptr<PikopterCmd> pik;
+		std::unique_ptr<ExecuteCommand> executeCommand;
+		std::thread loop_thread;
+};
+
+/*!
+ * \brief The navdata node loaded in a nodelet manager
+ * The handlers run on the threads of the manager, the sender keeps its own thread.
+ * It takes the acknowledgments of a cmd nodelet of the same process directly.
+ */
+class NavdataNodelet : public nodelet::Nodelet {
+
+	// Public part
+	public:
+		NavdataNodelet();
+		virtual ~NavdataNodelet();
+
+	// Private part
+	private:
+		virtual void onInit();
+
+		std::unique_ptr<PikopterNavdata> pn;
+};
+
+}
+
+#endif
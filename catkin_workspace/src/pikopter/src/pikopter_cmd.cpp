@@ -5,614 +5,2475 @@ using namespace std;
 
 /* Declarations */
 //char *STATION_IP = NULL;
-static struct sockaddr_in addr_drone;
-int comfd = 0; // in read mode -- receive command
-
-typedef struct command {
-	string cmd;
-	int seq;
-	int tcmd;
-	int param1;
-	int param2;
-	int param3;
-	int param4;
-	int param5;
-} Command;
 
 
 /* Functions */
 
 /**
- * Wait for any custom or mavros service passed in parameter during a fixed timeout.
+ * Constructor
+ * Initialize all mavros services used, the executor thread waits for them.
+ * NodeHandle advertising for all topics used.
+ * The subscriptions use callback_queue, or the queue of node_handle if NULL.
  */
-void waitForService(const std::string service) {
-	bool mavros_available = ros::service::waitForService(service, MAVROS_WAIT_TIMEOUT);
-	if (!mavros_available) {
-		ROS_FATAL("Mavros not launched, timeout of %dms reached, exiting...", MAVROS_WAIT_TIMEOUT);
-		ROS_INFO("Maybe the service you asked does not exist");
-		exit(ERROR_ENCOUNTERED);
-	}
+ExecuteCommand::ExecuteCommand(const ros::NodeHandle &node_handle, const ros::NodeHandle &private_nh, ros::CallbackQueueInterface *callback_queue) {
+	ros::NodeHandle nh(node_handle);
+	if (callback_queue) nh.setCallbackQueue(callback_queue);
+	arming_client.init(nh, "mavros/cmd/arming");
+	set_mode_client.init(nh, "mavros/set_mode");
+	takeoff_client.init(nh, "mavros/cmd/takeoff");
+	land_client.init(nh, "mavros/cmd/land");
+
+
+	navdatas = nh.advertise<std_msgs::Bool>("pikopter_cmd/cmd_received", 100);
+	setpoint_raw_pub = nh.advertise<mavros_msgs::PositionTarget>("/mavros/setpoint_raw/local", 100);
+	executor_status_pub = nh.advertise<std_msgs::String>("pikopter_cmd/executor_status", 10);
+	link_state_pub = nh.advertise<std_msgs::UInt8>("pikopter_cmd/link_state", 1, true);
+	navdata_demo_pub = nh.advertise<std_msgs::Bool>("pikopter_cmd/navdata_demo", 1, true);
+	linkState(LINK_STATE_OK);
+
+	// Stream the velocity setpoints at a fixed rate
+	double setpoint_rate;
+	int setpoint_silence_ms;
+	private_nh.param("setpoint_rate", setpoint_rate, (double) SETPOINT_STREAM_RATE);
+	private_nh.param("setpoint_silence_ms", setpoint_silence_ms, SETPOINT_SILENCE_MS);
+	streamer.start(setpoint_raw_pub, setpoint_rate, setpoint_silence_ms);
+
+	// Trajectories uploaded by the clients, fed to the same stream
+	double trajectory_rate;
+	private_nh.param("trajectory_rate", trajectory_rate, (double) TRAJECTORY_RATE);
+	trajectory_pub = nh.advertise<std_msgs::UInt32MultiArray>("pikopter_cmd/trajectory", 1, true);
+	threads_started = trajectory_runner.start(&streamer, trajectory_pub, trajectory_rate);
+
+	// Shaping of the stick values
+	double deadband, expo;
+	private_nh.param("stick_deadband", deadband, STICK_DEADBAND);
+	private_nh.param("stick_expo", expo, STICK_EXPO);
+	stick_deadband = fminf(fmaxf(deadband, 0.0), 0.99);
+	stick_deadband_scale = 1.0f / (1.0f - stick_deadband);
+	stick_expo = fminf(fmaxf(expo, 0.0), 1.0);
+
+	// Emergency cut-off, connected to mavros from now on
+	int emergency_fifo_priority;
+	private_nh.param("emergency_fifo_priority", emergency_fifo_priority, EMERGENCY_FIFO_PRIORITY);
+	threads_started = cutoff.start(nh, emergency_fifo_priority) && threads_started;
+
+	// The takeoff sequence is driven by the state published by mavros
+	fcu_connected = false;
+	fcu_armed = false;
+	fcu_guided = false;
+	state_sub = nh.subscribe("mavros/state", 10, &ExecuteCommand::handleState, this);
+
+	// Start the executor thread
+	current_op = OP_NONE;
+	current_stage = STAGE_IDLE;
+	emergency_queued = false;
+	executor_running = true;
+	executor_thread = std::thread(&ExecuteCommand::executorLoop, this);
 }
 
 /**
- * Constructor
- * Initialize all mavros services used.
- * Wait for all service to be ready.
- * NodeHandle advertising for all topics used.
+ * Destructor
+ * Stop the executor thread, an operation in progress is abandoned.
  */
-ExecuteCommand::ExecuteCommand() {
-	ros::NodeHandle nh;
-    arming_client = nh.serviceClient<mavros_msgs::CommandBool>
-            ("mavros/cmd/arming");
-    set_mode_client = nh.serviceClient<mavros_msgs::SetMode>
-            ("mavros/set_mode");
-    takeoff_client = nh.serviceClient<mavros_msgs::CommandTOL>
-            ("mavros/cmd/takeoff");
-    land_client = nh.serviceClient<mavros_msgs::CommandTOL>
-    		("mavros/cmd/land");
-    command_long_client = nh.serviceClient<mavros_msgs::CommandLong>
-    		("mavros/cmd/command");
+ExecuteCommand::~ExecuteCommand() {
+	trajectory_runner.stop();
+	streamer.stop();
+
+	executor_running = false;
+	executor_wakeup.notify_one();
+	if (executor_thread.joinable()) executor_thread.join();
+
+	set_mode_client.displayStats();
+	arming_client.displayStats();
+	takeoff_client.displayStats();
+	land_client.displayStats();
+}
 
+/**
+ * The emergency cut-off and the trajectory threads were started by the constructor.
+ */
+bool ExecuteCommand::ready() {
+	return threads_started;
+}
 
-    ROS_INFO("Wait for land service");
-	waitForService("/mavros/cmd/land");
+/**
+ * Keep the last state published by mavros.
+ */
+void ExecuteCommand::handleState(const mavros_msgs::State::ConstPtr& msg) {
+	fcu_connected = msg->connected;
+	fcu_armed = msg->armed;
+	fcu_guided = (msg->mode == "GUIDED");
+}
 
-	ROS_INFO("Wait for takeoff service");
-	waitForService("/mavros/cmd/takeoff");
+/**
+ * Convert int sent by Jakopter to a rate in [-1, 1], shaped by the params of the node.
+ */
+float ExecuteCommand::convertSpeedARDroneToRate(int speed) const {
+	return decodeStick(speed, stick_deadband, stick_deadband_scale, stick_expo);
+}
 
-	ROS_INFO("Wait for set_mode service");
-	waitForService("/mavros/set_mode");
+/**
+ * Decode a stick value of the AR.Drone protocol.
+ * The protocol sends the IEEE-754 float of the stick reinterpreted as an int32,
+ * so the float is read back from its bits, any value is supported.
+ * The rate is clamped, then the deadband removes small values (the response stays
+ * continuous after it) and the expo curve softens the center of the stick.
+ * No branch nor log here: this is called for every axis of every PCMD.
+ */
+float ExecuteCommand::decodeStick(int speed, float deadband, float deadband_scale, float expo) {
+	static_assert(sizeof(float) == sizeof(int), "The AR.Drone floats are sent as int32");
 
-	ROS_INFO("Wait for set_mode service");
-	waitForService("/mavros/cmd/arming");
+	float rate;
+	memcpy(&rate, &speed, sizeof(rate));
 
-	ROS_INFO("Wait for commandLong service");
-	waitForService("mavros/cmd/command");
+	// A NaN sent by a broken client stops the axis, then std::min/max clamp inline
+	rate = (rate == rate) ? rate : 0.0f;
+	rate = std::min(std::max(rate, -1.0f), 1.0f);
 
+	// Deadband, rescaled so that the full stick still gives 1
+	float magnitude = std::max(fabsf(rate) - deadband, 0.0f) * deadband_scale;
+	rate = copysignf(magnitude, rate);
 
+	// Expo: mix of the linear and the cubic response
+	return rate * ((1.0f - expo) + expo * rate * rate);
+}
 
-	velocity_pub = nh.advertise<geometry_msgs::TwistStamped>("/mavros/setpoint_velocity/cmd_vel", 100);
-	navdatas = nh.advertise<std_msgs::Bool>("pikopter_cmd/cmd_received", 100);
-	setpoint_raw_pub = nh.advertise<mavros_msgs::PositionTarget>("/mavros/setpoint_raw/local", 100);
+/**
+ * Takeoff command.
+ * The takeoff sequence runs on the executor thread, see stepOperation().
+ * Return false if the executor queue is full.
+ */
+bool ExecuteCommand::takeoff() {
+	ROS_INFO("Takeoff asked");
+	trajectory_runner.abort("takeoff");
+	return queueOperation(OP_TAKEOFF);
 }
 
 /**
- * Convert int sent by Jakopter to a rate.
- * This int is received for forward and backward movement.
- * If the rate is positive it is a forward.
- * Otherwise it is a backward.
+ * Land command.
+ * The land runs on the executor thread, it aborts a takeoff in progress.
+ * Return false if the executor queue is full.
  */
-float ExecuteCommand::convertSpeedARDroneToRate(int speed) {
-	float rateConvert = 0;
-	ROS_INFO("Receiving value speed : %d", speed);
-	switch(speed) {
-		case 1028443341 :
-			rateConvert = 0.05;
-			break;
-		case 1036831949 :
-			rateConvert = 0.1;
-			break;
-		case 1045220557 :
-			rateConvert = 0.2;
-			break;
-		case 1048576000 :
-			rateConvert = 0.25;
-			break;
-		case 1056964608 :
-			rateConvert = 0.5;
-			break;
-		case 1061158912 :
-			rateConvert = 0.75;
-			break;
-		case 1065353216 :
-			rateConvert = 1.0;
-			break;
-		case -1119040307 :
-			rateConvert = -0.05;
-			break;
-		case -1110651699 :
-			rateConvert = -0.1;
-			break;
-		case -1102263091 :
-			rateConvert = -0.2;
-			break;
-		case -1098907648 :
-			rateConvert = -0.25;
-			break;
-		case -1090519040 :
-			rateConvert = -0.5;
-			break;
-		case -1086324736 :
-			rateConvert = -0.75;
-			break;
-		case -1082130432 :
-			rateConvert = -1.0;
-			break;
-		default :
-			rateConvert = 0.0;
-			ROS_ERROR("Problem when converting rate");
-			ROS_INFO("Received : %d", speed);
-			ROS_INFO("Please relaunch the command or script");
-			break;
-	}
-	return rateConvert;
+bool ExecuteCommand::land() {
+	ROS_INFO("Land asked");
+	trajectory_runner.abort("land");
+	streamer.hold(false);
+	return queueOperation(OP_LAND);
 }
 
 /**
- * Takeoff command.
- * First, it will change mode to GUIDED mode.
- * Then it will arm the wehicle.
- * By default the altitude reached after taking off is 10 (meters).
- * If change mode or arming vehicle failed it will return false.
- * Otherwise if the vehicle has taken off it will return true.
+ * Hand an operation over to the executor thread.
+ * Called from the receive thread only (single producer of the queue).
  */
-bool ExecuteCommand::takeoff() {
-	ROS_INFO("Takeoff asked");
-	mavros_msgs::SetMode srvGuided;
-	mavros_msgs::CommandTOL srvTakeOffLand;
-	mavros_msgs::CommandBool srvArmed;
-
-	srvGuided.request.custom_mode = "GUIDED";
-	srvGuided.request.base_mode = 0;
-	srvTakeOffLand.request.altitude = 5;
-	srvArmed.request.value = true;
-
-	set_mode_client.call(srvGuided);
-	if (srvGuided.response.success) {
-		ROS_INFO("Guided mode enabled");
-	} else {
-		ROS_ERROR("Unable to set mode to GUIDED");
+bool ExecuteCommand::queueOperation(executor_op op) {
+	if (!executor_queue.push(op)) {
+		ROS_ERROR("Executor queue full, operation %d dropped", op);
 		return false;
 	}
+	executor_wakeup.notify_one();
+	return true;
+}
 
-	sleep(1);
+/**
+ * Wait for the services of mavros, all at the same time against one deadline.
+ * Runs on the executor thread so that the commands are received meanwhile:
+ * the operations queued start once the wait is over. A service still missing
+ * is not fatal, its calls fail until mavros shows up.
+ */
+void ExecuteCommand::waitForMavros() {
+	std::vector<std::string> services;
+	services.push_back("/mavros/cmd/land");
+	services.push_back("/mavros/cmd/takeoff");
+	services.push_back("/mavros/set_mode");
+	services.push_back("/mavros/cmd/arming");
+
+	if (PikopterNetwork::wait_for_services(services, MAVROS_WAIT_TIMEOUT) > 0)
+		ROS_ERROR("Mavros not ready after %dms, the takeoff and land will fail until it is", MAVROS_WAIT_TIMEOUT);
+}
 
-	arming_client.call(srvArmed);
-    if (srvArmed.response.success) {
-    	ROS_INFO("Drone armed");
-    } else {
-    	ROS_ERROR("Unable to arm drone");
-		return false;
-	}
+/**
+ * Executor thread.
+ * Take the operations from the queue, a new operation replaces the one in progress,
+ * then make the current operation progress by one step.
+ */
+void ExecuteCommand::executorLoop() {
+	waitForMavros();
+
+	while (executor_running) {
+		executor_op op;
+		while (executor_queue.pop(op)) {
+			if (op == OP_NONE) emergency_queued = false;
+			startOperation(op);
+		}
 
-	sleep(1);
+		if (current_op != OP_NONE) stepOperation();
 
-    takeoff_client.call(srvTakeOffLand);
-	if (srvTakeOffLand.response.success) {
-		ROS_INFO("Drone flying");
-	} else {
-		ROS_ERROR("Unable to takeoff");
-		return false;
+		// Sleep until the next step or until a new operation is queued
+		std::unique_lock<std::mutex> lock(executor_wakeup_mutex);
+		int wait_ms = (current_op != OP_NONE) ? EXECUTOR_TICK_MS : EXECUTOR_IDLE_WAIT_MS;
+		executor_wakeup.wait_for(lock, std::chrono::milliseconds(wait_ms));
 	}
-	return true;
 }
 
 /**
- * Land command.
- * First, it will change mode to GUIDED mode if it's not the case.
- * If change mode it will return false.
- * Otherwise if the vehicle has landed it will return true.
-
+ * Start an operation, the operation in progress is aborted.
  */
-bool ExecuteCommand::land() {
-	mavros_msgs::CommandTOL srvTakeOffLand;
+void ExecuteCommand::startOperation(executor_op op) {
+	if (current_op != OP_NONE) finishOperation(false, "aborted by a new operation");
 
-	srvTakeOffLand.request.altitude = 0;
+	current_op = op;
+	op_start = std::chrono::steady_clock::now();
 
-    land_client.call(srvTakeOffLand);
-	if (srvTakeOffLand.response.success) {
-		ROS_INFO("Drone lands");
-	} else {
-		ROS_ERROR("Drone cannot land");
-		return false;
+	switch (op) {
+		case OP_TAKEOFF:
+			setStage(STAGE_SET_GUIDED);
+			break;
+		case OP_LAND:
+			setStage(STAGE_LAND);
+			break;
+		default:
+			current_op = OP_NONE;
+			break;
 	}
-	return true;
 }
 
 /**
- * Forward command.
- * Given an int corresponding to forward/backaward movement (sent by Jakopter), convert this int to a rate.
+ * One step of the state machine of the current operation.
+ * Takeoff: GUIDED mode, then arming, then takeoff. Instead of sleeping between
+ * the service calls, each stage waits for mavros/state to report the state asked.
  */
-void ExecuteCommand::forward(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
+void ExecuteCommand::stepOperation() {
+	switch (current_stage) {
+
+		case STAGE_SET_GUIDED: {
+			if (fcu_guided) {
+				setStage(STAGE_ARM);
+				break;
+			}
+
+			mavros_msgs::SetMode srvGuided;
+			srvGuided.request.custom_mode = "GUIDED";
+			srvGuided.request.base_mode = 0;
+
+			if (set_mode_client.call(srvGuided) && srvGuided.response.success) setStage(STAGE_WAIT_GUIDED);
+			else finishOperation(false, "unable to set mode to GUIDED");
+			break;
+		}
+
+		case STAGE_WAIT_GUIDED:
+			if (fcu_guided) setStage(STAGE_ARM);
+			else if (stageTimedOut()) finishOperation(false, "GUIDED mode not reported by mavros");
+			break;
 
-	msgPosRawPub.coordinate_frame = 8; // FRAME_BODY_NED
-	msgPosRawPub.type_mask = 0xFC7;
+		case STAGE_ARM: {
+			if (fcu_armed) {
+				setStage(STAGE_TAKEOFF);
+				break;
+			}
+
+			mavros_msgs::CommandBool srvArmed;
+			srvArmed.request.value = true;
+
+			if (arming_client.call(srvArmed) && srvArmed.response.success) setStage(STAGE_WAIT_ARMED);
+			else finishOperation(false, "unable to arm drone");
+			break;
+		}
+
+		case STAGE_WAIT_ARMED:
+			if (fcu_armed) setStage(STAGE_TAKEOFF);
+			else if (stageTimedOut()) finishOperation(false, "arming not reported by mavros");
+			break;
+
+		case STAGE_TAKEOFF: {
+			mavros_msgs::CommandTOL srvTakeOffLand;
+			srvTakeOffLand.request.altitude = TAKEOFF_ALTITUDE;
 
-	geometry_msgs::Vector3 vector;
+			if (takeoff_client.call(srvTakeOffLand) && srvTakeOffLand.response.success) finishOperation(true, "drone flying");
+			else finishOperation(false, "unable to takeoff");
+			break;
+		}
 
-	vector.x = (rate) * ((float) MAX_SPEED_CMD) * (-1.0);
-	vector.y = 0.0;
-	vector.z = 0.0;
+		case STAGE_LAND: {
+			mavros_msgs::CommandTOL srvTakeOffLand;
+			srvTakeOffLand.request.altitude = 0;
+
+			if (land_client.call(srvTakeOffLand) && srvTakeOffLand.response.success) finishOperation(true, "drone lands");
+			else finishOperation(false, "drone cannot land");
+			break;
+		}
 
-	msgPosRawPub.velocity = vector;
-	setpoint_raw_pub.publish(msgPosRawPub);
+		default:
+			break;
+	}
 }
 
+// Names of the operations and of the stages for the reports
+static const char *executor_op_names[] = { "none", "takeoff", "land" };
+static const char *executor_stage_names[] = { "idle", "set_guided", "wait_guided", "arm", "wait_armed", "takeoff", "land" };
+
 /**
- * Backward command.
- * Given an int corresponding to forward/backward movement (sent by Jakopter), convert this int to a rate.
+ * Enter a new stage of the current operation and report it.
  */
-void ExecuteCommand::backward(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-
-	msgPosRawPub.coordinate_frame = 8; // FRAME_BODY_NED
-	msgPosRawPub.type_mask = 0xFC7;
+void ExecuteCommand::setStage(executor_stage stage) {
+	current_stage = stage;
+	stage_start = std::chrono::steady_clock::now();
 
-	geometry_msgs::Vector3 vector;
+	std_msgs::String status;
+	status.data = std::string(executor_op_names[current_op]) + ": " + executor_stage_names[stage];
+	executor_status_pub.publish(status);
 
-	vector.x = (rate) * (MAX_SPEED_CMD) * (-1.0);
-	vector.y = 0.0;
-	vector.z = 0.0;
-
-	msgPosRawPub.velocity = vector;
-	setpoint_raw_pub.publish(msgPosRawPub);
+	ROS_INFO("Executor %s", status.data.c_str());
 }
 
 /**
- * Allows drone to go down
+ * End the current operation and report its result.
  */
-void ExecuteCommand::down(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-	msgMove.twist.linear.z = (rate) * (RATIO_Z);
-	velocity_pub.publish(msgMove);
+void ExecuteCommand::finishOperation(bool success, const char *reason) {
+	long duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - op_start).count();
+
+	std_msgs::String status;
+	status.data = std::string(executor_op_names[current_op]) + (success ? ": succeeded, " : ": failed at ") +
+		(success ? "" : std::string(executor_stage_names[current_stage]) + ", ") + reason;
+	executor_status_pub.publish(status);
+
+	if (success) ROS_INFO("Executor %s (%ldms)", status.data.c_str(), duration);
+	else ROS_ERROR("Executor %s (%ldms)", status.data.c_str(), duration);
+
+	current_op = OP_NONE;
+	current_stage = STAGE_IDLE;
 }
 
 /**
- * Allows drone to go up
+ * True if the current stage waits for mavros for too long.
  */
-void ExecuteCommand::up(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-	msgMove.twist.linear.z = (rate) * (RATIO_Z);
-	velocity_pub.publish(msgMove);
+bool ExecuteCommand::stageTimedOut() {
+	return std::chrono::steady_clock::now() - stage_start > std::chrono::milliseconds(EXECUTOR_STAGE_TIMEOUT_MS);
 }
 
-/*
- * Turn to left
- * Maximum : 45 degrees
+/**
+ * Progressive command.
+ * Given the roll, pitch, gaz and yaw sent by Jakopter, convert them to rates and stream
+ * one setpoint carrying all the axes, so diagonal or climbing-while-turning moves are possible.
+ * The setpoint is in the body frame of mavros: x forward, y left, z up, yaw rate counter-clockwise.
  */
-void ExecuteCommand::left(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
+void ExecuteCommand::move(int roll, int pitch, int gaz, int yaw) {
+	trajectory_runner.abort("PCMD");
 
-	mavros_msgs::CommandLong srvCommand;
+	msgPosRawPub.coordinate_frame = mavros_msgs::PositionTarget::FRAME_BODY_NED;
+	msgPosRawPub.type_mask = SETPOINT_VELOCITY_YAW_RATE_MASK;
 
-	srvCommand.request.command = 115; // MAV_CMD_CONDITION_YAW
-	srvCommand.request.confirmation = 0;
-	srvCommand.request.param1 = abs((rate) * ((float) MAX_VEL_TURN_CMD));
-	srvCommand.request.param3 = -1.0;
-	srvCommand.request.param4 = 1.0;
+	// Negative pitch goes forward, negative roll slides to the left
+	msgPosRawPub.velocity.x = convertSpeedARDroneToRate(pitch) * ((float) MAX_SPEED_CMD) * (-1.0);
+	msgPosRawPub.velocity.y = convertSpeedARDroneToRate(roll) * ((float) MAX_SPEED_CMD) * (-1.0);
+	msgPosRawPub.velocity.z = convertSpeedARDroneToRate(gaz) * (RATIO_Z);
 
-	command_long_client.call(srvCommand);
-	if (srvCommand.response.success) {
-		ROS_INFO("Turn to left success");
-	} else {
-		ROS_ERROR("Unable to turn left");
-	}
+	// Negative yaw turns to the left
+	msgPosRawPub.yaw_rate = convertSpeedARDroneToRate(yaw) * ((float) MAX_VEL_TURN_CMD) * (-M_PI / 180.0);
+
+	streamer.update(msgPosRawPub);
 }
 
-/*
- * Turn to right
- * Maximum : 45 degrees
+/**
+ * Stay command (PCMD without any movement), also sent by the link-loss watchdog.
+ * The stream goes on with a zero velocity so the drone hovers.
  */
-void ExecuteCommand::right(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-
-	mavros_msgs::CommandLong srvCommand;
+void ExecuteCommand::stay() {
+	trajectory_runner.abort("hover");
+
+	msgPosRawPub.coordinate_frame = mavros_msgs::PositionTarget::FRAME_BODY_NED;
+	msgPosRawPub.type_mask = SETPOINT_VELOCITY_YAW_RATE_MASK;
+	msgPosRawPub.velocity = geometry_msgs::Vector3();
+	msgPosRawPub.yaw_rate = 0.0;
+	streamer.update(msgPosRawPub);
+}
 
-	srvCommand.request.command = 115; // MAV_CMD_CONDITION_YAW
-	srvCommand.request.confirmation = 0;
-	srvCommand.request.param1 = abs((rate) * ((float) MAX_VEL_TURN_CMD));
-	srvCommand.request.param3 = 1.0;
-	srvCommand.request.param4 = 1.0;
+/**
+ * First stage of the link-loss watchdog: hover, unless a trajectory is running.
+ * A trajectory runs on board without the client, so it goes on; the land stage
+ * of the watchdog still aborts it. The stream is held until the land, or until
+ * the link comes back.
+ */
+void ExecuteCommand::watchdogHover() {
+	streamer.hold(true);
 
-	command_long_client.call(srvCommand);
-	if (srvCommand.response.success) {
-		ROS_INFO("Turn to right success");
-	} else {
-		ROS_ERROR("Unable to turn right");
+	if (trajectory_runner.active()) {
+		ROS_WARN("Trajectory running, not hovering");
+		return;
 	}
+	stay();
 }
 
 /**
- * Slide to right.
+ * A PCMD has been received, even an unchanged one: the stream must go on.
  */
-void ExecuteCommand::slide_right(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-
-	msgPosRawPub.coordinate_frame = 8; // FRAME_BODY_NED
-	msgPosRawPub.type_mask = 0xFC7;
+void ExecuteCommand::keepAlive() {
+	streamer.refresh();
+}
 
-	geometry_msgs::Vector3 vector;
+/**
+ * Tell the navdata node the state of the command link (LINK_STATE_*).
+ */
+void ExecuteCommand::linkState(uint8_t state) {
 
-	vector.x = 0.0;
-	vector.y = (rate) * (MAX_SPEED_CMD) * (-1.0);
-	vector.z = 0.0;
+	// The watchdog gives the drone back, the stream follows the PCMD again
+	if (state == LINK_STATE_OK) streamer.hold(false);
 
-	msgPosRawPub.velocity = vector;
-	setpoint_raw_pub.publish(msgPosRawPub);
+	std_msgs::UInt8::Ptr msg = boost::make_shared<std_msgs::UInt8>();
+	msg->data = state;
+	link_state_pub.publish(msg);
 }
 
-/**
- * Slide to left.
- * Minimum : 1 meter
- * Maximum : 10 meters
+/*
+ * Forward the navdata mode asked by a client to the navdata node
  */
-void ExecuteCommand::slide_left(int accel) {
-	float rate = convertSpeedARDroneToRate(accel);
-
-	msgPosRawPub.coordinate_frame = 8; // FRAME_BODY_NED
-	msgPosRawPub.type_mask = 0xFC7;
+void ExecuteCommand::navdataDemo(bool demo) {
+	std_msgs::Bool::Ptr msg = boost::make_shared<std_msgs::Bool>();
+	msg->data = demo;
+	navdata_demo_pub.publish(msg);
+}
 
-	geometry_msgs::Vector3 vector;
+/*
+ * Emergency asked by a client: the motors are cut on the cut-off thread,
+ * and the operation in progress is abandoned so that a takeoff does not arm again.
+ * received is the kernel reception time of the datagram, 0 if unknown.
+ */
+void ExecuteCommand::emergency(int64_t received) {
+	cutoff.trigger(received);
+	trajectory_runner.abort("emergency");
 
-	vector.x = 0.0;
-	vector.y = (rate) * (MAX_SPEED_CMD) * (-1.0);
-	vector.z = 0.0;
+	// The client repeats the emergency at its command rate, one abort waiting is enough
+	if (!emergency_queued.exchange(true) && !queueOperation(OP_NONE)) emergency_queued = false;
+}
 
-	msgPosRawPub.velocity = vector;
-	setpoint_raw_pub.publish(msgPosRawPub);
+/*
+ * Chunk of a trajectory sent by a client, see TrajectoryRunner::upload().
+ */
+void ExecuteCommand::uploadTrajectory(uint32_t id, uint32_t flags, int32_t first, const struct at_arg &points) {
+	trajectory_runner.upload(id, flags, first, points.str, points.len);
 }
 
 /*
  * Acknowledgement which allows to send signal to navdatas that a command is sending to the drone
+ * Raised directly in the navdata when it runs in the same process, published otherwise.
  */
 void ExecuteCommand::cmd_received() {
-	std_msgs::Bool status;
-	status.data = true;
+	if (CommandAckLink::signal()) return;
+
+	std_msgs::Bool::Ptr status = boost::make_shared<std_msgs::Bool>();
+	status->data = true;
 	navdatas.publish(status);
 }
 
-/*!
- * \brief Parsing command
- *
- * \param buf the buffer containing the command
- *
- * \return the command
+/**
+ * Constructor
+ * The stream thread is started by start().
+ */
+SetpointStreamer::SetpointStreamer() {
+	running = false;
+	pending = false;
+	streaming = false;
+	held = false;
+	published = 0;
+
+	turn_pending = false;
+	turns = 0;
+	turn_latency_sum_us = 0;
+	turn_latency_max_us = 0;
+	last_yaw_rate = 0;
+	yaw_step_max = 0;
+	publish_interval_max_us = 0;
+}
+
+/**
+ * Destructor
  */
-Command parseCommand(char *buf, ExecuteCommand executeCommand) {
-	Command command;
-	char cmd[PACKET_SIZE];
-	int seq, tcmd, p1, p2, p3, p4, p5;
+SetpointStreamer::~SetpointStreamer() {
+	stop();
+}
 
-	static int pseq, ptcmd = 0, pp1 = 0, pp2 = 0, pp3 = 0, pp4 = 0, pp5 = 0;
+/**
+ * Start the stream thread.
+ * rate is the publishing rate in hertz, silence_ms the time without PCMD after which the stream stops.
+ */
+void SetpointStreamer::start(const ros::Publisher &raw_pub, double rate, int silence_ms) {
+	if (rate <= 0) rate = SETPOINT_STREAM_RATE;
 
-	//AT*FTRIM=7
-	//AT*REF=78,290718208
+	this->raw_pub = raw_pub;
+	period = std::chrono::nanoseconds((long long)(1e9 / rate));
+	silence = std::chrono::milliseconds(silence_ms);
 
-	command.seq = 0;
-	command.tcmd = 0;
-	command.param1 = 0;
-	command.param2 = 0;
-	command.param3 = 0;
-	command.param4 = 0;
-	command.param5 = 0;
+	running = true;
+	stream_thread = std::thread(&SetpointStreamer::streamLoop, this);
 
-	executeCommand.cmd_received();
+	ROS_INFO("Setpoints streamed at %.1fHz, stopped after %dms of silence", rate, silence_ms);
+}
 
-	if (!buf) return command;
+/**
+ * Stop the stream thread.
+ */
+void SetpointStreamer::stop() {
+	{
+		std::lock_guard<std::mutex> lock(setpoint_mutex);
+		if (!running) return;
+		running = false;
+	}
+	setpoint_changed.notify_one();
+	if (stream_thread.joinable()) stream_thread.join();
+
+	ROS_INFO("Setpoint stream: %lu setpoints published", published);
+	if (turns > 0) ROS_INFO("Setpoint turns: %lu yaw rate changes, latency mean %ldus max %ldus, yaw rate step max %.2frad/s, interval max %ldus",
+		turns, turn_latency_sum_us / (long) turns, turn_latency_max_us, yaw_step_max, publish_interval_max_us);
+}
 
-	// use sscan to parse the command
-	if(sscanf(buf, "AT*FTRIM=%d", &seq) == 1) {
-		tcmd = ERROR_ENCOUNTERED;
-		if(tcmd != ptcmd) {
-			fprintf(stderr, "%s\n", "AT*FTRIM");
+/**
+ * Replace the streamed setpoint, published right away by the stream thread.
+ */
+void SetpointStreamer::update(const mavros_msgs::PositionTarget &target) {
+	{
+		std::lock_guard<std::mutex> lock(setpoint_mutex);
+		last_command = std::chrono::steady_clock::now();
+
+		// The turn latency runs from the first PCMD changing the yaw rate
+		if (target.yaw_rate != this->target.yaw_rate && !turn_pending) {
+			turn_pending = true;
+			turn_received = last_command;
 		}
-		command.cmd = "AT*FTRIM";
+
+		this->target = target;
+		pending = true;
 	}
+	setpoint_changed.notify_one();
+}
 
-	else if(sscanf(buf, "AT*REF=%d, %d", &seq, &tcmd) == 2) {
-		switch(tcmd) {
-		case 290718208:
-			if(tcmd != ptcmd) {
-				fprintf(stderr, "%s\n", "DECOLLAGE");
-				executeCommand.takeoff();
-			}
-			break;
+/**
+ * Push back the end of the stream, the setpoint is unchanged.
+ */
+void SetpointStreamer::refresh() {
+	bool restart;
+	{
+		std::lock_guard<std::mutex> lock(setpoint_mutex);
+		last_command = std::chrono::steady_clock::now();
+
+		// The same PCMD is sent again after a silence, the stream starts again
+		restart = !streaming && published;
+		if (restart) pending = true;
+	}
+	if (restart) setpoint_changed.notify_one();
+}
 
-		case 290717696:
-			if(tcmd != ptcmd) {
-				fprintf(stderr, "%s\n","ATTERRISSAGE");
-				executeCommand.land();
-			}
-			break;
+/**
+ * Keep the stream going without PCMD, or let the silence stop it again.
+ * Offboard control falls back as soon as the setpoints stop, so the hover of the
+ * watchdog is streamed until a land is commanded. On release the silence period
+ * starts over, the new mode has the time to take over.
+ */
+void SetpointStreamer::hold(bool held) {
+	bool restart;
+	{
+		std::lock_guard<std::mutex> lock(setpoint_mutex);
+		if (this->held == held) return;
+		this->held = held;
+		last_command = std::chrono::steady_clock::now();
+
+		restart = held && !streaming && published;
+		if (restart) pending = true;
+	}
+	if (restart) setpoint_changed.notify_one();
+}
 
-		case 290717952:
-			if(tcmd != ptcmd)
-				fprintf(stderr, "%s\n","EMERGENCY");
-			break;
+/**
+ * Stream thread.
+ * Publish the latest setpoint on every tick and as soon as a new one arrives,
+ * until the silence period is over, unless the stream is held.
+ */
+void SetpointStreamer::streamLoop() {
+	std::chrono::steady_clock::time_point next_tick = std::chrono::steady_clock::now();
 
-		default:
-			fprintf(stderr, "%s\n","UNKNOWN");
-			break;
-		}
-		command.cmd = "AT*REF";
-	}
-
-	else if(sscanf(buf, "AT*PCMD=%d, %d, %d, %d, %d, %d", &seq, &p1, &p2, &p3, &p4, &p5) == 6) {
-		if((p1 != pp1) || (p2 != pp2) || (p3 != pp3) || (p4 != pp4) || (p5 != pp5)) {
-			if(p1 || p2 || p3 || p4 || p5) {
-				if ((p1 == 1) && !p2 && (p3 < 0) && !p4 && !p5){
-					fprintf(stderr, "%s\n","FORWARD");
-					executeCommand.forward(p3);
-				}
-				else if((p1 == 1) && !p2 && (p3 > 0) && !p4 && !p5) {
-					fprintf(stderr, "%s\n","BACKWARD");
-					executeCommand.backward(p3);
-				}
-				else if((p1 == 1) && !p2 && !p3 && (p4 < 0) && !p5) {
-					fprintf(stderr, "%s\n","DOWN");
-					executeCommand.down(p4);
-				}
-				else if((p1 == 1) && !p2 && !p3 && (p4 > 0) && !p5) {
-					fprintf(stderr, "%s\n","UP");
-					executeCommand.up(p4);
-				}
-				else if((p1 == 1) && !p2 && !p3 && !p4 && (p5 < 0)) {
-					fprintf(stderr, "%s\n","LEFT");
-					executeCommand.left(p5);
-				}
-				else if((p1 == 1) && !p2 && !p3 && !p4 && (p5 > 0)) {
-					fprintf(stderr, "%s\n","RIGHT");
-					executeCommand.right(p5);
-				}
-				else if((p1 == 1) && (p2 < 0) && !p3 && !p4 && !p5) {
-					fprintf(stderr, "%s\n","SLIDE_LEFT");
-					executeCommand.slide_left(p2);
-				}
-				else if((p1 == 1) && (p2 > 0) && !p3 && !p4 && !p5) {
-					//CHECK IT
-					fprintf(stderr, "%s\n","SLIDE_RIGHT");
-					executeCommand.slide_right(p2);
-				}
-				else {
-					fprintf(stderr,"received PCMD: %d,%d,%d,%d,%d,%d\n",seq,p1,p2,p3,p4,p5);
-				}
-			}
+	std::unique_lock<std::mutex> lock(setpoint_mutex);
+	while (running) {
 
-			else {
-				fprintf(stderr, "%s\n","STAY");
+		// Wait for the next tick while streaming, or for a new setpoint
+		if (streaming) setpoint_changed.wait_until(lock, next_tick);
+		else setpoint_changed.wait(lock);
+		if (!running) break;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		if (pending) {
+			pending = false;
+			if (!streaming) {
+				ROS_DEBUG("Setpoint stream started");
+				last_publish = std::chrono::steady_clock::time_point();
 			}
+			streaming = true;
 		}
-		pp1 = p1; pp2= p2; pp3= p3; pp4= p4; pp5= p5;
-		command.cmd = "AT*PCMD";
-	}
-
-	ptcmd = tcmd;
+		else if (now < next_tick) continue;
 
-	command.seq = seq;
-	command.param1 = pp1;
-	command.param2 = pp2;
-	command.param3 = pp3;
-	command.param4 = pp4;
-	command.param5 = pp5;
-	command.tcmd = ptcmd;
+		if (!held && now - last_command > silence) {
+			ROS_DEBUG("Setpoint stream stopped, no PCMD since %ldms", (long) silence.count());
+			streaming = false;
+			continue;
+		}
 
+		// Publish a copy outside of the lock, the latest setpoint wins
+		mavros_msgs::PositionTarget::Ptr target_copy = boost::make_shared<mavros_msgs::PositionTarget>(target);
+		bool carries_turn = turn_pending;
+		turn_pending = false;
+		lock.unlock();
+
+		target_copy->header.stamp = ros::Time::now();
+		raw_pub.publish(target_copy);
+		std::chrono::steady_clock::time_point published_at = std::chrono::steady_clock::now();
+
+		lock.lock();
+		++published;
+		next_tick = now + period;
+
+		// Turn latency and smoothness of the yaw rate channel
+		if (carries_turn) {
+			long latency_us = std::chrono::duration_cast<std::chrono::microseconds>(published_at - turn_received).count();
+			++turns;
+			turn_latency_sum_us += latency_us;
+			if (latency_us > turn_latency_max_us) turn_latency_max_us = latency_us;
+		}
+		yaw_step_max = fmaxf(yaw_step_max, fabsf(target_copy->yaw_rate - last_yaw_rate));
+		last_yaw_rate = target_copy->yaw_rate;
+		if (last_publish != std::chrono::steady_clock::time_point()) {
+			long interval_us = std::chrono::duration_cast<std::chrono::microseconds>(published_at - last_publish).count();
+			if (interval_us > publish_interval_max_us) publish_interval_max_us = interval_us;
+		}
+		last_publish = published_at;
+	}
+}
 
-	return command;
+/**
+ * Get the wall clock in nanoseconds, the clock of the kernel receive timestamps.
+ */
+static int64_t realtimeNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-//////////////////// Parrot channels
-unsigned char commandBuffer[PACKET_SIZE+1];
+/**
+ * Monotonic time in nanoseconds, the clock of the timerfd.
+ */
+static int64_t monotonicNow() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-/*!
- * \brief Launcher of Ros node cmd
- *
- * \param argc Number of parameters
- * \param argv The arguments
- *
+/**
+ * Constructor
+ * The cut-off thread is started by start().
  */
-int main(int argc, char *argv[]) {
-	// Initialize ros for this node
-	ros::init(argc, argv, "pikopter_cmd");
+EmergencyCutoff::EmergencyCutoff() {
+	running = false;
+	received = 0;
+	cutoffs = 0;
+	retries = 0;
+	over_bound = 0;
+	latency_sum_us = 0;
+	latency_max_us = 0;
+
+	// Blocking reads: the thread sleeps in read() until an emergency
+	event_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_fd < 0) ROS_FATAL("Unable to create the emergency eventfd (errno: %d)", errno);
+}
 
-	// Create a node handle (fully initialize ros)
-	ros::NodeHandle cmd_node_handle;
+/**
+ * Destructor
+ */
+EmergencyCutoff::~EmergencyCutoff() {
+	stop();
+	close(event_fd);
+}
 
-	ros::NodeHandle cmd_private_nh("~");
+/**
+ * Start the cut-off thread, it opens its connection to mavros right away.
+ * fifo_priority puts the thread in SCHED_FIFO, 0 keeps the default policy.
+ * Return false if the eventfd could not be created, the thread is not started.
+ */
+bool EmergencyCutoff::start(const ros::NodeHandle &node_handle, int fifo_priority) {
+	if (event_fd < 0) return false;
+	command_client.init(node_handle, "mavros/cmd/command");
+
+	running = true;
+	cutoff_thread = std::thread(&EmergencyCutoff::cutoffLoop, this);
+
+	// It is not fatal if we don't have the right to
+	if (fifo_priority > 0) {
+		struct sched_param param;
+		param.sched_priority = fifo_priority;
+		int err = pthread_setschedparam(cutoff_thread.native_handle(), SCHED_FIFO, &param);
+		if (err != 0) ROS_WARN("Emergency cut-off keeps the default policy, SCHED_FIFO %d refused: %s", fifo_priority, strerror(err));
+		else ROS_INFO("Emergency cut-off running with SCHED_FIFO priority %d", fifo_priority);
+	}
 
-	std::string ip;
+	return true;
+}
 
-	if(!cmd_private_nh.getParam("ip", ip)) {
-		ROS_FATAL("Missing ip parameter");
-		return ERROR_ENCOUNTERED;
-	}
+/**
+ * Stop the cut-off thread.
+ */
+void EmergencyCutoff::stop() {
+	if (!running) return;
+	running = false;
 
-	char* cstr = new char[ip.length() + 1];
-	strcpy(cstr, ip.c_str());
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0) ROS_ERROR("Unable to wake up the emergency cut-off (errno: %d)", errno);
+	if (cutoff_thread.joinable()) cutoff_thread.join();
 
-	ros::start();
+	if (cutoffs > 0) ROS_INFO("Emergency cut-off: %lu force disarms (%lu retries), reception to call mean %ldus max %ldus, %lu above %dus",
+		cutoffs, retries, latency_sum_us / (long) cutoffs, latency_max_us, over_bound, EMERGENCY_LATENCY_BOUND_US);
+	command_client.displayStats();
+}
 
-	// Instance of PikopterCmd class
-	PikopterCmd pik;
+/**
+ * Ask for a force disarm.
+ * received is the kernel reception time of the datagram (CLOCK_REALTIME ns), 0 if unknown.
+ */
+void EmergencyCutoff::trigger(int64_t received) {
+	this->received = received ? received : realtimeNow();
 
-	int i = MAX_CMD_NAVDATA;
-	socklen_t len = sizeof(addr_drone);
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0) ROS_ERROR("Unable to wake up the emergency cut-off (errno: %d)", errno);
+}
 
-	// Struct for handling timeout
-	struct timeval tv;
+/**
+ * Cut-off thread.
+ * Open the connection, then sleep until an emergency. The force disarm is sent
+ * again every EMERGENCY_RETRY_MS until mavros acknowledges it; once it has, the
+ * emergencies the client keeps repeating for EMERGENCY_ACK_HOLD_MS are not sent again.
+ */
+void EmergencyCutoff::cutoffLoop() {
+	connect();
 
-	// set a timeout
-	tv.tv_sec = 0;
-  	tv.tv_usec = 100000; // 100ms
+	int64_t disarmed_at = 0;
+	while (running) {
+		if (!waitTrigger(-1)) continue;
+		if (!running) break;
 
-  	Command command;
+		if (disarmed_at && monotonicNow() - disarmed_at < (int64_t) EMERGENCY_ACK_HOLD_MS * 1000000LL) continue;
 
-  	ROS_INFO("Adresse ip : %s", cstr);
+		bool disarmed = forceDisarm(false);
+		while (!disarmed && running) {
+			waitTrigger(EMERGENCY_RETRY_MS);
+			if (running) disarmed = forceDisarm(true);
+		}
+		disarmed_at = monotonicNow();
+	}
+}
 
-	// Open the UDP port for the cmd node
-	comfd = PikopterNetwork::open_udp_socket(PORT_CMD, &addr_drone, cstr);
+/**
+ * Wait for trigger() or stop(), timeout_ms -1 waits forever.
+ * Return true if woken up, the requests pending are consumed.
+ */
+bool EmergencyCutoff::waitTrigger(int timeout_ms) {
+	struct pollfd fd;
+	fd.fd = event_fd;
+	fd.events = POLLIN;
 
-  	if (setsockopt(comfd, SOL_SOCKET, SO_RCVTIMEO,&tv,sizeof(tv)) < 0) {
-  		ROS_ERROR("%s", "Error timeout");
-  	}
+	int ready = poll(&fd, 1, timeout_ms);
+	if (ready < 0 && errno != EINTR) ROS_ERROR("Emergency cut-off wait failed (errno: %d)", errno);
+	if (ready <= 0) return false;
 
-  	// send a ping DO NOT ERASE PLEASE
-  	// Allows to keep connection on
-  	if (sendto(comfd,"\0",1, 0, (struct sockaddr*)&addr_drone, sizeof(addr_drone)) < 0) {
-  		ROS_ERROR("%s", "sendto()");
-  	}
+	uint64_t requests;
+	return read(event_fd, &requests, sizeof(requests)) == sizeof(requests);
+}
 
+/**
+ * Open the persistent connection with a harmless command,
+ * an emergency arriving meanwhile is served right after.
+ */
+void EmergencyCutoff::connect() {
+	std::vector<std::string> services(1, "/mavros/cmd/command");
+	if (PikopterNetwork::wait_for_services(services, MAVROS_WAIT_TIMEOUT) > 0) {
+		ROS_ERROR("Emergency cut-off not connected, the first emergency opens the connection");
+		return;
+	}
 
-  	/* This test is no more used while we use file .launch to launch this node */
-	// if(argc < 2) {
-	// 	ROS_FATAL("No IP address\n use: %s \"ip_address\"\n", argv[0]);
-	// 	return ERROR_ENCOUNTERED;
-	// }
+	mavros_msgs::CommandLong srv;
+	srv.request.command = MAV_CMD_REQUEST_AUTOPILOT_CAPABILITIES;
+	srv.request.param1 = 1;
+	command_client.call(srv);
+}
 
-	ExecuteCommand executeCommand;
+/**
+ * Send the force disarm: the motors stop even in flight.
+ * The latency is measured on the first call of an emergency, not on its retries.
+ * Return true if mavros acknowledged it.
+ */
+bool EmergencyCutoff::forceDisarm(bool retry) {
+	mavros_msgs::CommandLong srv;
+	srv.request.command = MAV_CMD_COMPONENT_ARM_DISARM;
+	srv.request.param1 = 0;
+	srv.request.param2 = MAV_FORCE_DISARM_MAGIC;
+
+	// Time from the reception of the datagram to the call
+	long latency_us = (long) ((realtimeNow() - received) / 1000);
+	if (retry) ++retries;
+	else {
+		++cutoffs;
+		latency_sum_us += latency_us;
+		if (latency_us > latency_max_us) latency_max_us = latency_us;
+		if (latency_us > EMERGENCY_LATENCY_BOUND_US) {
+			++over_bound;
+			ROS_WARN("Emergency cut-off called %ldus after the reception, above the bound of %dus", latency_us, EMERGENCY_LATENCY_BOUND_US);
+		}
+	}
 
-	delete [] cstr;
+	if (command_client.call(srv) && srv.response.success) {
+		ROS_WARN("EMERGENCY: motors disarmed (%ldus after the reception)", latency_us);
+		return true;
+	}
 
-	// ROS LOOP
-	while(ros::ok()) {
+	ROS_ERROR_THROTTLE(1, "EMERGENCY: force disarm refused by mavros, sent again every %dms", EMERGENCY_RETRY_MS);
+	return false;
+}
 
-		// Erase buffer commandBuffer
-		memset(commandBuffer, 0, PACKET_SIZE);
+/*
+ * AT*REF handler: takeoff, land and emergency.
+ */
+static void handleRef(const struct at_command &command, struct parser_state &state, ExecuteCommand &executeCommand) {
+	int32_t tcmd = command.args[0].value;
+
+	switch(tcmd) {
+	case AT_REF_TAKEOFF:
+		if(tcmd != state.ptcmd) {
+			fprintf(stderr, "%s\n", "DECOLLAGE");
+			executeCommand.takeoff();
+		}
+		break;
 
-		// fprintf(stderr, "Waiting packet from %s:%d\n", inet_ntoa(addr_drone.sin_addr), ntohs(addr_drone.sin_port));
+	case AT_REF_LAND:
+		if(tcmd != state.ptcmd) {
+			fprintf(stderr, "%s\n","ATTERRISSAGE");
+			executeCommand.land();
+		}
+		break;
 
-		// need to add a watchdog here
-		int ret = recvfrom(comfd, commandBuffer, PACKET_SIZE, 0, (struct sockaddr*) &addr_drone, &len);
+	// The cut-off is already triggered by the receive loop, before the filters of the parser
+	case AT_REF_EMERGENCY:
+		if(tcmd != state.ptcmd) fprintf(stderr, "%s\n","EMERGENCY");
+		break;
 
-		// if we receive something...
-		if(ret > 0) {
-			// Get command
-			//printf("%s\n", commandBuffer);
-			command = parseCommand((char *) commandBuffer, executeCommand);
+	default:
+		fprintf(stderr, "%s\n","UNKNOWN");
+		break;
+	}
 
-			if(!command.cmd.empty()) {
-				//cout << "Command received : " << command.cmd << "\n";
-			}
-			// printf("Seq number received : %d\n", command.seq);
-			// printf("tcmd received : %d\n", command.tcmd);
-			// printf("Param 1 received : %d\n", command.param1);
-			// printf("Param 2 received : %d\n", command.param2);
-			// printf("Param 3 received : %d\n", command.param3);
-			// printf("Param 4 received : %d\n", command.param4);
-			// printf("Param 5 received : %d\n", command.param5);
+	state.ptcmd = tcmd;
+}
 
+/*
+ * AT*PCMD handler: progressive commands (flag, roll, pitch, gaz, yaw).
+ * AT*PCMD_MAG carries two more arguments for the magnetometer which are ignored.
+ */
+static void handlePcmd(const struct at_command &command, struct parser_state &state, ExecuteCommand &executeCommand) {
+	int32_t p1 = command.args[0].value;
+	int32_t p2 = command.args[1].value;
+	int32_t p3 = command.args[2].value;
+	int32_t p4 = command.args[3].value;
+	int32_t p5 = command.args[4].value;
+
+	if((p1 != state.pp1) || (p2 != state.pp2) || (p3 != state.pp3) || (p4 != state.pp4) || (p5 != state.pp5)) {
+		if((p1 & PCMD_PROGRESSIVE_FLAG) && (p2 || p3 || p4 || p5)) {
+			fprintf(stderr, "MOVE: %d,%d,%d,%d\n", p2, p3, p4, p5);
+			executeCommand.move(p2, p3, p4, p5);
 		}
 
-		// if nothing is received
 		else {
-			// if time is out
-			if(errno != 11)
-			// 	ROS_ERROR("%s", "Receiving command time out \n");
-
-			// // if other errors occured
-			// else
-				ROS_ERROR("Receiving command, %d, failed (errno: %d)\n", i, errno);
-
-			// We should send ping again... for server
-			sendto(comfd, "\0", 1, 0, (struct sockaddr*) &addr_drone, sizeof(addr_drone));
+			fprintf(stderr, "%s\n","STAY");
+			executeCommand.stay();
 		}
-
-		ros::spinOnce();
 	}
+	executeCommand.keepAlive();
+	state.pp1 = p1; state.pp2 = p2; state.pp3 = p3; state.pp4 = p4; state.pp5 = p5;
+}
+
+/*
+ * AT*FTRIM handler: flat trim, nothing to do with mavros.
+ */
+static void handleFtrim(const struct at_command & /* command */, struct parser_state & /* state */, ExecuteCommand & /* executeCommand */) {
+	fprintf(stderr, "%s\n", "AT*FTRIM");
+}
+
+/*
+ * AT*CALIB handler: magnetometer calibration is not forwarded yet.
+ */
+static void handleCalib(const struct at_command & /* command */, struct parser_state & /* state */, ExecuteCommand & /* executeCommand */) {
+	fprintf(stderr, "%s\n", "AT*CALIB");
+}
+
+/*
+ * Compare a quoted argument with a string.
+ */
+static bool argEquals(const struct at_arg &arg, const char *value) {
+	size_t len = strlen(value);
+	return arg.str && arg.len == len && memcmp(arg.str, value, len) == 0;
+}
+
+/*
+ * AT*CONFIG handler: general:navdata_demo switches the navdata mode, the other keys are ignored.
+ */
+static void handleConfig(const struct at_command &command, struct parser_state & /* state */, ExecuteCommand &executeCommand) {
+	ROS_DEBUG("AT*CONFIG %.*s = %.*s", command.args[0].len, command.args[0].str, command.args[1].len, command.args[1].str);
+
+	if (argEquals(command.args[0], CONFIG_NAVDATA_DEMO)) {
+		if (argEquals(command.args[1], CONFIG_TRUE))
+			executeCommand.navdataDemo(true);
+		else if (argEquals(command.args[1], CONFIG_FALSE))
+			executeCommand.navdataDemo(false);
+		else
+			ROS_WARN("AT*CONFIG %s with an invalid value %.*s", CONFIG_NAVDATA_DEMO, command.args[1].len, command.args[1].str);
+	}
+}
+
+/*
+ * AT*PTRAJ handler: chunk of a trajectory (id, flags, index of its first point, "points").
+ * The id 0 aborts the trajectory, its points can be empty.
+ */
+static void handlePtraj(const struct at_command &command, struct parser_state & /* state */, ExecuteCommand &executeCommand) {
+	if (command.args[0].value != 0 && !command.args[3].str) {
+		ROS_WARN("AT*PTRAJ %d without its points", command.args[0].value);
+		return;
+	}
+	executeCommand.uploadTrajectory((uint32_t) command.args[0].value, (uint32_t) command.args[1].value, command.args[2].value, command.args[3]);
+}
+
+/*
+ * Dispatch table of the AT commands, keyed on the verb.
+ * Entries are in the order of at_verb so a tokenized command indexes it directly.
+ * A NULL handler accepts the command without doing anything.
+ */
+static const struct at_dispatch_entry at_dispatch_table[] = {
+	{ "REF",        3, AT_REF,        1, handleRef },
+	{ "PCMD",       4, AT_PCMD,       5, handlePcmd },
+	{ "PCMD_MAG",   8, AT_PCMD_MAG,   5, handlePcmd },
+	{ "FTRIM",      5, AT_FTRIM,      0, handleFtrim },
+	{ "CONFIG",     6, AT_CONFIG,     2, handleConfig },
+	{ "CONFIG_IDS", 10, AT_CONFIG_IDS, 3, NULL },
+	{ "COMWDG",     6, AT_COMWDG,     0, NULL },
+	{ "CALIB",      5, AT_CALIB,      1, handleCalib },
+	{ "CTRL",       4, AT_CTRL,       1, NULL },
+	{ "LED",        3, AT_LED,        3, NULL },
+	{ "ANIM",       4, AT_ANIM,       2, NULL },
+	{ "PTRAJ",      5, AT_PTRAJ,      4, handlePtraj }
+};
+
+#define AT_DISPATCH_TABLE_SIZE (sizeof(at_dispatch_table) / sizeof(at_dispatch_table[0]))
+
+static_assert(AT_DISPATCH_TABLE_SIZE == AT_PTRAJ, "The dispatch table must have one entry per known verb");
+
+/*
+ * Find the entry of a verb in the dispatch table, NULL if unknown.
+ */
+static const struct at_dispatch_entry *findVerb(const char *verb, int len) {
+	for (unsigned int k = 0; k < AT_DISPATCH_TABLE_SIZE; ++k) {
+		if (at_dispatch_table[k].len == len && memcmp(at_dispatch_table[k].name, verb, len) == 0)
+			return &at_dispatch_table[k];
+	}
+	return NULL;
+}
+
+/*
+ * Read a signed decimal integer, the values wrap like the int32 sent by the clients.
+ * Return the position after the integer, NULL if there is no digit.
+ */
+static const char *parseInteger(const char *p, const char *end, int32_t &value) {
+	bool negative = false;
+	uint32_t result = 0;
+
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		++p;
+	}
+	if (p >= end || *p < '0' || *p > '9') return NULL;
+
+	while (p < end && *p >= '0' && *p <= '9') {
+		result = result * 10 + (uint32_t)(*p - '0');
+		++p;
+	}
+
+	value = (int32_t)(negative ? (0u - result) : result);
+	return p;
+}
+
+/*!
+ * \brief Tokenize one AT command in a single pass, without any allocation
+ *
+ * \param buf the start of the command
+ * \param end the end of the datagram
+ * \param command the tokenized command, strings point into buf
+ *
+ * \return the position after the command (after its '\r'), NULL if the command is malformed
+ */
+const char *tokenizeCommand(const char *buf, const char *end, struct at_command &command) {
+	const char *p = buf;
+
+	command.verb = AT_UNKNOWN;
+	command.seq = 0;
+	command.nargs = 0;
+
+	// Prefix AT*
+	if (end - p < 3 || p[0] != 'A' || p[1] != 'T' || p[2] != '*') return NULL;
+	p += 3;
+
+	// Verb up to '='
+	const char *verb = p;
+	while (p < end && *p != '=' && *p != '\r') ++p;
+	if (p >= end || *p != '=') return NULL;
+
+	const struct at_dispatch_entry *entry = findVerb(verb, (int)(p - verb));
+	if (entry) command.verb = entry->verb;
+	++p;
+
+	// Sequence number
+	p = parseInteger(p, end, command.seq);
+	if (!p) return NULL;
+
+	// Arguments separated by commas, integers or quoted strings
+	while (p < end && *p != '\r' && *p != '\0') {
+		if (*p != ',') return NULL;
+		++p;
+		while (p < end && *p == ' ') ++p;
+
+		if (command.nargs == AT_MAX_ARGS) return NULL;
+		struct at_arg &arg = command.args[command.nargs];
+
+		if (p < end && *p == '"') {
+			arg.str = ++p;
+			while (p < end && *p != '"') ++p;
+			if (p >= end) return NULL;
+			arg.len = (uint16_t)(p - arg.str);
+			arg.value = 0;
+			++p;
+		}
+		else {
+			p = parseInteger(p, end, arg.value);
+			if (!p) return NULL;
+			arg.str = NULL;
+			arg.len = 0;
+		}
+		++command.nargs;
+
+		while (p < end && *p == ' ') ++p;
+	}
+
+	// Skip the terminator of the command
+	if (p < end && *p == '\r') ++p;
+
+	return p;
+}
+
+/*!
+ * \brief Execute a tokenized command through the dispatch table
+ *
+ * \param command the tokenized command
+ * \param state the change detection state of the parser
+ * \param executeCommand the executor of the commands
+ *
+ * \return true if the command has been recognized
+ */
+bool dispatchCommand(const struct at_command &command, struct parser_state &state, ExecuteCommand &executeCommand) {
+	if (command.verb == AT_UNKNOWN) return false;
+
+	const struct at_dispatch_entry &entry = at_dispatch_table[command.verb - 1];
+	if (command.nargs < entry.nargs) return false;
+
+	if (entry.handler) entry.handler(command, state, executeCommand);
+
+	return true;
+}
+
+/*!
+ * \brief Check the sequence number of a command against the last one of its client
+ * A command is accepted if it is newer than the last one accepted. A client which
+ * restarts sends AT_SEQ_RESET. AT*COMWDG resets the numbering as well, unless it
+ * is behind the last command accepted: a reordered one is stale like any other.
+ *
+ * \return true if the command can be executed
+ */
+bool acceptSequence(struct cmd_client &client, const struct at_command &command, struct parser_stats &stats) {
+
+	// Difference computed on unsigned values so that the numbering can wrap
+	int32_t diff = (int32_t)((uint32_t) command.seq - (uint32_t) client.last_seq);
+
+	// Sequence reset
+	if (command.seq == AT_SEQ_RESET || (command.verb == AT_COMWDG && diff >= 0)) {
+		client.last_seq = command.seq;
+		return true;
+	}
+
+	if (diff == 0) {
+		++stats.dropped_duplicate;
+		return false;
+	}
+	if (diff < 0) {
+		++stats.dropped_stale;
+		return false;
+	}
+
+	client.last_seq = command.seq;
+	return true;
+}
+
+/*!
+ * \brief Check if a command asks for the emergency: an AT*REF with the emergency bit
+ */
+bool isEmergency(const struct at_command &command) {
+	return command.verb == AT_REF && command.nargs >= 1 && (command.args[0].value & AT_REF_EMERGENCY_BIT);
+}
+
+/*!
+ * \brief Look for an emergency in a datagram, before any filter of the parser
+ * The datagram is tokenized on its own: an emergency is served even if its datagram
+ * is too old, out of sequence, duplicated or sent by an observer.
+ *
+ * \param buf the buffer containing the commands
+ * \param len the length of the buffer
+ *
+ * \return true if one of the commands is an emergency
+ */
+bool containsEmergency(const char *buf, int len) {
+	struct at_command command;
+
+	// Most datagrams have no AT*REF at all
+	if (!buf || !memmem(buf, len, "AT*REF=", 7)) return false;
+
+	const char *p = buf;
+	const char *end = buf + len;
+	while (p < end) {
+		while (p < end && (*p == '\r' || *p == '\n' || *p == ' ')) ++p;
+		if (p >= end || *p == '\0') break;
+
+		const char *next = tokenizeCommand(p, end, command);
+		if (!next) {
+			while (p < end && *p != '\r') ++p;
+			continue;
+		}
+		p = next;
+
+		if (isEmergency(command)) return true;
+	}
+
+	return false;
+}
+
+/*!
+ * \brief Arbitration of the sessions: what a session which is not the pilot may send
+ * Observers keep their session alive and may trigger the emergency, the control
+ * commands and the configuration belong to the pilot.
+ *
+ * \return true if the command is accepted from an observer
+ */
+bool observerAllowed(const struct at_command &command) {
+	switch (command.verb) {
+	case AT_COMWDG:
+	case AT_CTRL:
+	case AT_CONFIG_IDS:
+		return true;
+
+	case AT_REF:
+		return isEmergency(command);
+
+	default:
+		return false;
+	}
+}
+
+/*!
+ * \brief Arbitration of the sessions: what a session may take the free control with
+ * Only flying the drone does, a session which keeps its link alive or watches stays an observer.
+ *
+ * \return true for a control command
+ */
+bool takesControl(const struct at_command &command) {
+	switch (command.verb) {
+	case AT_PCMD:
+	case AT_PCMD_MAG:
+	case AT_PTRAJ:
+		return true;
+
+	case AT_REF:
+		return command.nargs >= 1 && !isEmergency(command);
+
+	default:
+		return false;
+	}
+}
+
+/*!
+ * \brief Parsing command
+ * A datagram can pack several commands terminated by '\r' (e.g. REF + PCMD + COMWDG),
+ * they are all handed to the scheduler, which runs them once the batch is parsed.
+ * A malformed command is skipped up to the next '\r'.
+ *
+ * \param buf the buffer containing the commands
+ * \param len the length of the buffer
+ * \param received the kernel reception time of the datagram, 0 if unknown
+ * \param client the session which sent the datagram, it holds the change detection state of the parser
+ * \param stats the counters of the parser
+ * \param scheduler the queue of the commands of the batch
+ * \param executeCommand the executor of the commands
+ *
+ * \return the number of commands queued
+ */
+int parseCommand(const char *buf, int len, int64_t received, struct cmd_client &client, struct parser_stats &stats, CommandScheduler &scheduler, ExecuteCommand &executeCommand) {
+	struct at_command command;
+	int queued = 0;
+
+	//AT*FTRIM=7
+	//AT*REF=78,290718208
+
+	if (!buf) return 0;
+
+	executeCommand.cmd_received();
+
+	const char *p = buf;
+	const char *end = buf + len;
+
+	while (p < end) {
+
+		// Skip the separators left between two commands
+		while (p < end && (*p == '\r' || *p == '\n' || *p == ' ')) ++p;
+		if (p >= end || *p == '\0') break;
+
+		const char *next = tokenizeCommand(p, end, command);
+
+		// Resynchronize on the next command
+		if (!next) {
+			++stats.malformed;
+			while (p < end && *p != '\r') ++p;
+			continue;
+		}
+		p = next;
+		command.received = received;
+
+		// Reordered or duplicated command
+		if (command.verb != AT_UNKNOWN && !acceptSequence(client, command, stats)) continue;
+
+		// A session allowed to pilot takes the free control with its first control command
+		if (!client.pilot && client.may_pilot && takesControl(command)) {
+			client.pilot = true;
+			client.may_pilot = false;
+		}
+
+		// Only the pilot controls the drone
+		if (command.verb != AT_UNKNOWN && !client.pilot && !observerAllowed(command)) {
+			++stats.dropped_observer;
+			continue;
+		}
+
+		scheduler.push(command, client, stats, executeCommand);
+		++queued;
+	}
+
+	++stats.datagrams;
+
+	if (stats.datagrams % CMD_PARSER_STATS_PERIOD == 0) displayParserStats(stats);
+
+	return queued;
+}
+
+/*!
+ * \brief Display the counters of the parser
+ */
+void displayParserStats(const struct parser_stats &stats) {
+	if (stats.datagrams == 0) return;
+
+	ROS_INFO("Commands: %lu in %lu datagrams (%.2f per datagram), %lu malformed, %lu unknown",
+		stats.commands, stats.datagrams, (double) stats.commands / stats.datagrams, stats.malformed, stats.unknown);
+	ROS_INFO("Commands dropped: %lu datagrams too old, %lu datagrams truncated, %lu duplicated, %lu stale, %lu from observers, %lu superseded",
+		stats.dropped_too_old, stats.dropped_truncated, stats.dropped_duplicate, stats.dropped_stale, stats.dropped_observer, stats.dropped_superseded);
+	if (stats.clock_steps)
+		ROS_WARN("Commands: %lu datagrams kept without checking their age, the realtime clock stepped", stats.clock_steps);
+
+	for (unsigned int k = 0; k < AT_DISPATCH_TABLE_SIZE; ++k) {
+		if (stats.verbs[at_dispatch_table[k].verb])
+			ROS_DEBUG("\t AT*%s : %lu", at_dispatch_table[k].name, stats.verbs[at_dispatch_table[k].verb]);
+	}
+}
+
+/**
+ * Constructor
+ * The thread is started by start(), nothing is uploaded yet.
+ */
+TrajectoryRunner::TrajectoryRunner() {
+	streamer = NULL;
+	period_ns = 1000000000LL / TRAJECTORY_RATE;
+	running = false;
+
+	staged_id = 0;
+	staged_count = 0;
+	staged_position = false;
+	staged_broken = false;
+
+	count = 0;
+	position = false;
+	id = 0;
+	state = TRAJECTORY_IDLE;
+	current = 0;
+	start_ns = 0;
+	elapsed_ns = 0;
+	last_progress_ns = 0;
+	tick_index = 0;
+
+	started = 0;
+	completed = 0;
+	aborted = 0;
+	ticks = 0;
+	tick_late_max_us = 0;
+
+	// Blocking reads: the thread sleeps in read() while no trajectory runs
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) ROS_FATAL("Unable to create the trajectory timer (errno: %d)", errno);
+}
+
+/**
+ * Destructor
+ */
+TrajectoryRunner::~TrajectoryRunner() {
+	stop();
+	close(timer_fd);
+}
+
+/**
+ * Start the thread executing the trajectories.
+ * The setpoints are given to streamer at rate hertz, the progress is published on progress_pub.
+ * Return false if the timer could not be created, the thread is not started.
+ */
+bool TrajectoryRunner::start(SetpointStreamer *streamer, const ros::Publisher &progress_pub, double rate) {
+	if (timer_fd < 0) return false;
+	if (rate <= 0) rate = TRAJECTORY_RATE;
+
+	this->streamer = streamer;
+	this->progress_pub = progress_pub;
+	period_ns = (int64_t) (1e9 / rate);
+
+	running = true;
+	run_thread = std::thread(&TrajectoryRunner::runLoop, this);
+
+	ROS_INFO("Trajectories executed at %.1fHz, up to %d points", rate, TRAJECTORY_MAX_POINTS);
+	return true;
+}
+
+/**
+ * Stop the thread, a trajectory in progress is abandoned.
+ */
+void TrajectoryRunner::stop() {
+	if (!running) return;
+	running = false;
+
+	// An expiration right away wakes the thread up
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_nsec = 1;
+	if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0) ROS_ERROR("Unable to wake up the trajectory thread (errno: %d)", errno);
+	if (run_thread.joinable()) run_thread.join();
+
+	if (started > 0) ROS_INFO("Trajectories: %lu started, %lu completed, %lu aborted, %lu setpoints, tick late max %ldus",
+		started, completed, aborted, ticks, tick_late_max_us);
+}
+
+/**
+ * Arm the timer on the absolute time first_ns, then every period. 0 disarms it.
+ */
+void TrajectoryRunner::armTimer(int64_t first_ns) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	if (first_ns) {
+		spec.it_value.tv_sec = first_ns / 1000000000LL;
+		spec.it_value.tv_nsec = first_ns % 1000000000LL;
+		spec.it_interval.tv_sec = period_ns / 1000000000LL;
+		spec.it_interval.tv_nsec = period_ns % 1000000000LL;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) ROS_ERROR("Unable to arm the trajectory timer (errno: %d)", errno);
+}
+
+/**
+ * Gather a chunk of AT*PTRAJ=seq,id,flags,first,"points".
+ * The points are "duration:x:y:z:yaw" separated by ';', the duration in ms. Velocities
+ * are in the body frame of move() (cm/s, yaw rate in deg/s), positions with
+ * PTRAJ_FLAG_POSITION in the local frame of mavros (cm, yaw in deg).
+ * first is the index of the first point of the chunk: a chunk which does not follow
+ * the previous one breaks the upload. A new id starts a new upload, the id 0 aborts.
+ * The last chunk (without PTRAJ_FLAG_MORE) replaces the trajectory running and starts.
+ */
+void TrajectoryRunner::upload(uint32_t id, uint32_t flags, int32_t first, const char *points, int len) {
+	if (id == 0) {
+		abort("aborted by the client");
+		return;
+	}
+
+	bool position = flags & PTRAJ_FLAG_POSITION;
+
+	// A new upload, a lost first chunk breaks it
+	if (id != staged_id || first == 0) {
+		staged_id = id;
+		staged_count = 0;
+		staged_position = position;
+		staged_broken = (first != 0);
+	}
+
+	if (!staged_broken && (first != staged_count || position != staged_position)) {
+		ROS_WARN("Trajectory %u: chunk starting at point %d after %d points", id, first, staged_count);
+		staged_broken = true;
+	}
+	if (!staged_broken && !parsePoints(points, len)) {
+		ROS_WARN("Trajectory %u: invalid or incomplete points after point %d (at most %d points)", id, staged_count, TRAJECTORY_MAX_POINTS);
+		staged_broken = true;
+	}
+
+	if (flags & PTRAJ_FLAG_MORE) return;
+
+	// The last chunk is a new command, the trajectory running stops
+	abort("replaced by a new trajectory");
+
+	std::lock_guard<std::mutex> lock(trajectory_mutex);
+	int64_t now = monotonicNow();
+
+	this->id = id;
+	current = 0;
+	elapsed_ns = 0;
+
+	if (staged_broken || staged_count == 0) {
+		ROS_WARN("Trajectory %u rejected", id);
+		count = 0;
+		state = TRAJECTORY_REJECTED;
+		staged_id = 0;
+		publishProgress(now);
+		return;
+	}
+
+	// Copy of the upload, the end of each point is computed once
+	count = staged_count;
+	this->position = staged_position;
+	memcpy(this->points, staged, count * sizeof(struct trajectory_point));
+	int64_t end_ns = 0;
+	for (int k = 0; k < count; ++k) {
+		end_ns += (int64_t) this->points[k].duration_ms * 1000000LL;
+		point_end_ns[k] = end_ns;
+	}
+	staged_id = 0;
+
+	// The first setpoint goes out at once, the next ones on the ticks of the timer
+	state = TRAJECTORY_RUNNING;
+	start_ns = now;
+	tick_index = 0;
+	++started;
+
+	mavros_msgs::PositionTarget target;
+	setpoint(this->points[0], target);
+	streamer->update(target);
+	armTimer(start_ns + period_ns);
+
+	ROS_INFO("Trajectory %u started: %d %s points, %ldms", id, count, this->position ? "position" : "velocity", (long) (end_ns / 1000000LL));
+	publishProgress(now);
+}
+
+/**
+ * Append the points of a chunk to the upload.
+ * The velocities are clamped to the limits of the PCMD.
+ * A point is never split between two chunks: a chunk whose last point misses
+ * fields is malformed, it breaks the upload instead of being joined to the next one.
+ * Return false if a point is malformed or if there are too many points.
+ */
+bool TrajectoryRunner::parsePoints(const char *p, int len) {
+	const char *end = p + len;
+
+	while (p < end) {
+		if (staged_count == TRAJECTORY_MAX_POINTS) return false;
+
+		// duration:x:y:z:yaw
+		int32_t values[5];
+		for (int k = 0; k < 5; ++k) {
+			if (k > 0) {
+				if (p >= end || *p != ':') return false;
+				++p;
+			}
+			p = parseInteger(p, end, values[k]);
+			if (!p) return false;
+		}
+		if (p < end && *p++ != ';') return false;
+		if (values[0] <= 0) return false;
+
+		struct trajectory_point &point = staged[staged_count++];
+		point.duration_ms = (uint32_t) values[0];
+		point.x = values[1] / 100.0f;
+		point.y = values[2] / 100.0f;
+		point.z = values[3] / 100.0f;
+		point.yaw = values[4] * (float) (M_PI / 180.0);
+
+		if (!staged_position) {
+			point.x = fminf(fmaxf(point.x, -MAX_SPEED_CMD), MAX_SPEED_CMD);
+			point.y = fminf(fmaxf(point.y, -MAX_SPEED_CMD), MAX_SPEED_CMD);
+			point.z = fminf(fmaxf(point.z, -RATIO_Z), RATIO_Z);
+			point.yaw = fminf(fmaxf(point.yaw, -MAX_VEL_TURN_CMD * (float) (M_PI / 180.0)), MAX_VEL_TURN_CMD * (float) (M_PI / 180.0));
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Setpoint of a point of the trajectory running.
+ */
+void TrajectoryRunner::setpoint(const struct trajectory_point &point, mavros_msgs::PositionTarget &target) {
+	if (position) {
+		target.coordinate_frame = mavros_msgs::PositionTarget::FRAME_LOCAL_NED;
+		target.type_mask = SETPOINT_POSITION_YAW_MASK;
+		target.position.x = point.x;
+		target.position.y = point.y;
+		target.position.z = point.z;
+		target.yaw = point.yaw;
+	}
+	else {
+		target.coordinate_frame = mavros_msgs::PositionTarget::FRAME_BODY_NED;
+		target.type_mask = SETPOINT_VELOCITY_YAW_RATE_MASK;
+		target.velocity.x = point.x;
+		target.velocity.y = point.y;
+		target.velocity.z = point.z;
+		target.yaw_rate = point.yaw;
+	}
+}
+
+/**
+ * Stop the movement of a velocity trajectory, a position one stays on its last setpoint.
+ */
+void TrajectoryRunner::hover() {
+	if (position) return;
+
+	mavros_msgs::PositionTarget target;
+	target.coordinate_frame = mavros_msgs::PositionTarget::FRAME_BODY_NED;
+	target.type_mask = SETPOINT_VELOCITY_YAW_RATE_MASK;
+	target.velocity = geometry_msgs::Vector3();
+	target.yaw_rate = 0.0;
+	streamer->update(target);
+}
+
+/**
+ * Stop the trajectory running, it no longer feeds the stream once this returns.
+ * A velocity trajectory leaves the drone hovering.
+ */
+void TrajectoryRunner::abort(const char *reason) {
+	std::lock_guard<std::mutex> lock(trajectory_mutex);
+	if (state != TRAJECTORY_RUNNING) return;
+
+	armTimer(0);
+	int64_t now = monotonicNow();
+	elapsed_ns = now - start_ns;
+	state = TRAJECTORY_ABORTED;
+	++aborted;
+	hover();
+
+	ROS_WARN("Trajectory %u aborted at point %d/%d after %ldms: %s", id, current + 1, count, (long) (elapsed_ns / 1000000LL), reason);
+	publishProgress(now);
+}
+
+/**
+ * Check if a trajectory is running.
+ */
+bool TrajectoryRunner::active() {
+	std::lock_guard<std::mutex> lock(trajectory_mutex);
+	return state == TRAJECTORY_RUNNING;
+}
+
+/**
+ * Publish the progress of the trajectory for the navdata (TRAJECTORY_FIELD_*).
+ */
+void TrajectoryRunner::publishProgress(int64_t now) {
+	std_msgs::UInt32MultiArray::Ptr msg = boost::make_shared<std_msgs::UInt32MultiArray>();
+	msg->data.resize(TRAJECTORY_FIELDS);
+	msg->data[TRAJECTORY_FIELD_ID] = id;
+	msg->data[TRAJECTORY_FIELD_STATE] = state;
+	msg->data[TRAJECTORY_FIELD_POINT] = current;
+	msg->data[TRAJECTORY_FIELD_POINTS] = count;
+	msg->data[TRAJECTORY_FIELD_ELAPSED_MS] = (uint32_t) (elapsed_ns / 1000000LL);
+	msg->data[TRAJECTORY_FIELD_DURATION_MS] = count ? (uint32_t) (point_end_ns[count - 1] / 1000000LL) : 0;
+	progress_pub.publish(msg);
+
+	last_progress_ns = now;
+}
+
+/**
+ * Thread executing the trajectories.
+ * Sleep on the timer, armed only while a trajectory runs.
+ */
+void TrajectoryRunner::runLoop() {
+	while (running) {
+		uint64_t expirations;
+		if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+			if (errno != EINTR) ROS_ERROR("Trajectory timer wait failed (errno: %d)", errno);
+			continue;
+		}
+		if (!running) break;
+
+		tick(expirations);
+	}
+}
+
+/**
+ * Tick of the timer: feed the setpoint of the current point to the stream,
+ * or end the trajectory after its last point.
+ * The lock is held while feeding the stream, so that abort() is never overtaken.
+ */
+void TrajectoryRunner::tick(uint64_t expirations) {
+	std::lock_guard<std::mutex> lock(trajectory_mutex);
+	if (state != TRAJECTORY_RUNNING) return;
+
+	int64_t now = monotonicNow();
+	elapsed_ns = now - start_ns;
+
+	// Delay since the deadline of this tick
+	tick_index += expirations;
+	long late_us = (long) ((now - (start_ns + (int64_t) tick_index * period_ns)) / 1000);
+	if (late_us > tick_late_max_us) tick_late_max_us = late_us;
+
+	int previous = current;
+	while (current < count && elapsed_ns >= point_end_ns[current]) ++current;
+
+	// The last point is over
+	if (current == count) {
+		armTimer(0);
+		current = count - 1;
+		state = TRAJECTORY_DONE;
+		++completed;
+		hover();
+
+		ROS_INFO("Trajectory %u completed in %ldms", id, (long) (elapsed_ns / 1000000LL));
+		publishProgress(now);
+		return;
+	}
+
+	mavros_msgs::PositionTarget target;
+	setpoint(points[current], target);
+	streamer->update(target);
+	++ticks;
+
+	// The client learns at once that a point is reached
+	if (current != previous || now - last_progress_ns >= TRAJECTORY_PROGRESS_PERIOD_MS * 1000000LL) publishProgress(now);
+}
+
+/**
+ * Constructor
+ * Nothing waits in the queues.
+ */
+CommandScheduler::CommandScheduler() {
+	memset(depth, 0, sizeof(depth));
+	memset(class_stats, 0, sizeof(class_stats));
+	batches = 0;
+}
+
+/**
+ * Class of a command: the emergency and the land preempt, the PCMD are coalesced.
+ * The chunks of a trajectory are control commands, they must all run in order.
+ */
+command_class CommandScheduler::classify(const struct at_command &command) {
+	switch (command.verb) {
+		case AT_REF:
+			if (command.nargs >= 1 && (isEmergency(command) || command.args[0].value == AT_REF_LAND))
+				return CLASS_SAFETY;
+			return CLASS_CONTROL;
+
+		case AT_PCMD:
+		case AT_PCMD_MAG:
+			return CLASS_MOTION;
+
+		default:
+			return CLASS_CONTROL;
+	}
+}
+
+/**
+ * Queue a command of the batch being parsed.
+ * A PCMD replaces the one waiting: every PCMD carries all the axes, so the newest
+ * one is the newest value of each axis. A safety command drops the motion, the
+ * takeoff and the trajectories waiting, they came before it and must not run after it.
+ * The last chunk of a trajectory drops the motion waiting, which would abort it.
+ * If its class is full, the commands waiting in it and in the classes before it
+ * run first, in their order, then the command is queued in the emptied class.
+ */
+void CommandScheduler::push(const struct at_command &command, struct cmd_client &client, struct parser_stats &stats, ExecuteCommand &executeCommand) {
+	command_class cls = classify(command);
+
+	if (cls == CLASS_SAFETY) {
+		for (unsigned int k = 0; k < depth[CLASS_MOTION]; ++k) supersede(queues[CLASS_MOTION][k], CLASS_MOTION, stats);
+		for (unsigned int k = 0; k < depth[CLASS_CONTROL]; ++k) {
+			at_verb verb = queues[CLASS_CONTROL][k].command.verb;
+			if (verb == AT_REF || verb == AT_PTRAJ) supersede(queues[CLASS_CONTROL][k], CLASS_CONTROL, stats);
+		}
+	}
+	else if (command.verb == AT_PTRAJ && command.nargs >= 2 && !(command.args[1].value & PTRAJ_FLAG_MORE)) {
+		for (unsigned int k = 0; k < depth[CLASS_MOTION]; ++k) supersede(queues[CLASS_MOTION][k], CLASS_MOTION, stats);
+	}
+
+	struct scheduled_command *slot;
+	if (cls == CLASS_MOTION && depth[CLASS_MOTION] > 0) {
+		slot = &queues[CLASS_MOTION][0];
+		if (!slot->superseded) supersede(*slot, CLASS_MOTION, stats);
+	}
+	else {
+		// Full class: what waits in it and before it runs first, the order is kept
+		if (depth[cls] == CMD_SCHEDULER_DEPTH)
+			for (int before = CLASS_SAFETY; before <= cls; ++before) drainClass((command_class) before, stats, executeCommand);
+		slot = &queues[cls][depth[cls]++];
+	}
+
+	slot->command = command;
+	slot->client = &client;
+	slot->queued = monotonicNow();
+	slot->superseded = false;
+}
+
+/**
+ * Count a command waiting as replaced, it will not run.
+ */
+void CommandScheduler::supersede(struct scheduled_command &waiting, command_class cls, struct parser_stats &stats) {
+	if (waiting.superseded) return;
+	waiting.superseded = true;
+	++class_stats[cls].superseded;
+	++stats.dropped_superseded;
+}
+
+/**
+ * Run a command and account for its time in the queue.
+ */
+void CommandScheduler::execute(struct scheduled_command &waiting, command_class cls, int64_t now, struct parser_stats &stats, ExecuteCommand &executeCommand) {
+	struct scheduler_class_stats &cs = class_stats[cls];
+
+	if (!dispatchCommand(waiting.command, waiting.client->state, executeCommand)) {
+		++stats.unknown;
+		return;
+	}
+
+	++stats.verbs[waiting.command.verb];
+	++stats.commands;
+	++cs.executed;
+
+	int64_t wait = now - waiting.queued;
+	cs.wait_sum += wait;
+	if (wait > cs.wait_max) cs.wait_max = wait;
+}
+
+/**
+ * Run the commands of the batch, safety first, then control, then motion.
+ * Return the number of commands run.
+ */
+int CommandScheduler::drain(struct parser_stats &stats, ExecuteCommand &executeCommand) {
+	int ran = 0;
+
+	for (int cls = CLASS_SAFETY; cls < CLASS_COUNT; ++cls) ran += drainClass((command_class) cls, stats, executeCommand);
+
+	if (ran && ++batches % CMD_SCHEDULER_STATS_PERIOD == 0) displayStats();
+
+	return ran;
+}
+
+/**
+ * Run the commands waiting in one class, in their order, and empty it.
+ * Return the number of commands run.
+ */
+int CommandScheduler::drainClass(command_class cls, struct parser_stats &stats, ExecuteCommand &executeCommand) {
+	if (depth[cls] == 0) return 0;
+
+	struct scheduler_class_stats &cs = class_stats[cls];
+	++cs.batches;
+	cs.depth_sum += depth[cls];
+	if (depth[cls] > cs.depth_max) cs.depth_max = depth[cls];
+
+	int ran = 0;
+	for (unsigned int k = 0; k < depth[cls]; ++k) {
+		if (queues[cls][k].superseded) continue;
+		execute(queues[cls][k], cls, monotonicNow(), stats, executeCommand);
+		++ran;
+	}
+	depth[cls] = 0;
+
+	return ran;
+}
+
+/**
+ * Display the depth of the queues and the time spent in them, by class.
+ */
+void CommandScheduler::displayStats() {
+	static const char *class_names[] = { "safety", "control", "motion" };
+
+	for (int cls = CLASS_SAFETY; cls < CLASS_COUNT; ++cls) {
+		const struct scheduler_class_stats &cs = class_stats[cls];
+		if (cs.batches == 0) continue;
+
+		ROS_INFO("Scheduler %s: %lu run, %lu superseded, depth mean %.2f max %u, time in queue mean %ldus max %ldus",
+			class_names[cls], cs.executed, cs.superseded, (double) cs.depth_sum / cs.batches, cs.depth_max,
+			(long) (cs.executed ? cs.wait_sum / (int64_t) cs.executed / 1000 : 0), (long) (cs.wait_max / 1000));
+	}
+}
+
+/**
+ * Constructor
+ * Create the eventfd signaled when a callback is queued.
+ */
+EventfdCallbackQueue::EventfdCallbackQueue() {
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) ROS_FATAL("Unable to create the eventfd of the callback queue (errno: %d)", errno);
+}
+
+/**
+ * Destructor
+ */
+EventfdCallbackQueue::~EventfdCallbackQueue() {
+	close(event_fd);
+}
+
+/**
+ * Queue a callback then wake up the event loop.
+ * Called by the ROS threads which receive the messages.
+ */
+void EventfdCallbackQueue::addCallback(const ros::CallbackInterfacePtr &callback, uint64_t removal_id) {
+	ros::CallbackQueue::addCallback(callback, removal_id);
+
+	uint64_t one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ROS_ERROR("Unable to signal the callback queue (errno: %d)", errno);
+}
+
+/**
+ * The eventfd readable when callbacks are queued.
+ */
+int EventfdCallbackQueue::fd() {
+	return event_fd;
+}
+
+/**
+ * Clear the eventfd then call all the callbacks queued.
+ * Clearing first makes sure a callback queued meanwhile wakes up the loop again.
+ */
+void EventfdCallbackQueue::callPending() {
+	uint64_t count;
+	if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		ROS_ERROR("Unable to clear the callback queue event (errno: %d)", errno);
+
+	callAvailable();
+}
+
+/**
+ * Constructor
+ * Open the UDP socket of the commands and prepare the packet slots
+ * in which recvmmsg drains the datagrams. ready() tells whether it succeeded.
+ */
+PikopterCmd::PikopterCmd(char *ip_adress, int batch_size, int max_age_ms, int ping_period_ms, int hover_ms, int land_ms, const char *pilot_ip, int pilot_timeout_ms)
+	: epoll_fd(-1), timer_fd(-1), stop_fd(-1), pilot(NULL), pilot_addr(htonl(INADDR_ANY)),
+	  pilot_timeout((int64_t) pilot_timeout_ms * 1000000LL), session_timeout((int64_t) CMD_SESSION_TIMEOUT_MS * 1000000LL) {
+
+	// Open the UDP port for the cmd node
+	cmd_fd = PikopterNetwork::open_udp_socket(PORT_CMD, &addr_drone_cmd, ip_adress);
+	if (cmd_fd == ERROR_ENCOUNTERED) {
+		ROS_FATAL("Fatal error during the opening of the cmd socket");
+		return;
+	}
+
+	// Other clients reach us on the usual command port
+	if (PikopterNetwork::bind_udp_socket(cmd_fd, PORT_CMD) == ERROR_ENCOUNTERED)
+		ROS_WARN("Commands only received from the clients answering our pings");
+
+	// Ask the kernel to timestamp the datagrams when they are received
+	int enable = 1;
+	if (setsockopt(cmd_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+		ROS_ERROR("Unable to enable the receive timestamps (errno: %d), the age of the commands is not checked", errno);
+	}
+
+	// Keep the batch size in the range of the preallocated slots
+	if (batch_size < 1) batch_size = 1;
+	if (batch_size > CMD_BATCH_SIZE) batch_size = CMD_BATCH_SIZE;
+	this->batch_size = batch_size;
+
+	// Link every slot to its buffer and its source address once and for all
+	memset(batch_msgs, 0, sizeof(batch_msgs));
+	for (int k = 0; k < CMD_BATCH_SIZE; ++k) {
+		batch_iovecs[k].iov_base = batch_buffers[k];
+		batch_iovecs[k].iov_len = CMD_DATAGRAM_SIZE;
+		batch_msgs[k].msg_hdr.msg_iov = &batch_iovecs[k];
+		batch_msgs[k].msg_hdr.msg_iovlen = 1;
+		batch_msgs[k].msg_hdr.msg_name = &batch_addrs[k];
+		batch_msgs[k].msg_hdr.msg_control = batch_controls[k];
+	}
+
+	// The station given by the ip parameter has a session from the start, it gets the pings
+	for (int k = 0; k < CMD_MAX_CLIENTS; ++k) clients[k].active = false;
+	struct cmd_client &station = packetClient(-1, monotonicNow());
+	station.permanent = true;
+
+	// Arbitration: the first client flying the drone, or only the given address, pilots it
+	if (pilot_ip && *pilot_ip) {
+		struct in_addr addr;
+		if (inet_aton(pilot_ip, &addr) == 0) ROS_ERROR("Invalid pilot address %s, the first client flying pilots", pilot_ip);
+		else pilot_addr = addr.s_addr;
+	}
+
+	memset(batch_histogram, 0, sizeof(batch_histogram));
+	batch_wakeups = 0;
+	batch_packets = 0;
+
+	memset(&stats, 0, sizeof(stats));
+	this->max_age = (int64_t) max_age_ms * 1000000LL;
+	clock_offset = 0;
+	clock_stepped = false;
+	this->ping_period = (int64_t) ping_period_ms * 1000000LL;
+
+	// The landing must come after the hovering
+	if (land_ms <= hover_ms) {
+		ROS_WARN("Watchdog land delay %dms not after the hover delay %dms, using %dms", land_ms, hover_ms, hover_ms + CMD_WATCHDOG_HOVER_MS);
+		land_ms = hover_ms + CMD_WATCHDOG_HOVER_MS;
+	}
+	watchdog_hover = (int64_t) hover_ms * 1000000LL;
+	watchdog_land = (int64_t) land_ms * 1000000LL;
+	watchdog_armed = false;
+	link_state = LINK_STATE_OK;
+	watchdog_triggers = 0;
+	watchdog_latency_max = 0;
+	watchdog_latency_sum = 0;
+
+	// Timer of the ping deadline, stop request and epoll instance of the event loop
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	running = true;
+	if (timer_fd < 0 || stop_fd < 0 || epoll_fd < 0) {
+		ROS_FATAL("Unable to create the event loop of the cmd node (errno: %d)", errno);
+		return;
+	}
+
+	ROS_INFO("Command socket drains up to %d datagrams per wakeup", this->batch_size);
+
+	// send a ping DO NOT ERASE PLEASE
+	// Allows to keep connection on
+	ping(station);
+}
+
+/**
+ * Destructor
+ * Close the UDP socket.
+ */
+PikopterCmd::~PikopterCmd() {
+	int fds[] = { epoll_fd, stop_fd, timer_fd, cmd_fd };
+	for (unsigned int k = 0; k < sizeof(fds) / sizeof(fds[0]); ++k)
+		if (fds[k] >= 0) close(fds[k]);
+}
+
+/**
+ * The socket and the event loop were created by the constructor.
+ */
+bool PikopterCmd::ready() {
+	return cmd_fd >= 0 && timer_fd >= 0 && stop_fd >= 0 && epoll_fd >= 0;
+}
+
+/**
+ * Add the socket, the timer, the stop request and the callback queue to epoll.
+ * Done before run() so that the caller hears about a failure.
+ */
+bool PikopterCmd::watch(EventfdCallbackQueue &callback_queue) {
+	struct epoll_event event;
+
+	int fds[] = { cmd_fd, timer_fd, callback_queue.fd(), stop_fd };
+	for (unsigned int k = 0; k < sizeof(fds) / sizeof(fds[0]); ++k) {
+		event.events = EPOLLIN;
+		event.data.fd = fds[k];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[k], &event) < 0) {
+			ROS_FATAL("Unable to watch fd %d (errno: %d)", fds[k], errno);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Ask the event loop to return, from another thread.
+ * Needed by the nodelet: ros::ok() stays true while the manager runs.
+ */
+void PikopterCmd::stop() {
+	running = false;
+
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ROS_ERROR("Unable to wake up the event loop (errno: %d)", errno);
+}
+
+/**
+ * Event loop of the cmd node.
+ * Sleep until the command socket is readable, the ping deadline is reached
+ * or a ROS callback is queued, and handle it right away.
+ * The fds are added to epoll by watch() beforehand.
+ */
+void PikopterCmd::run(ExecuteCommand &executeCommand, EventfdCallbackQueue &callback_queue) {
+	struct epoll_event events[CMD_EPOLL_EVENTS];
+
+	// Callbacks queued before the loop
+	callback_queue.callPending();
+
+	last_received = monotonicNow();
+	armTimer(nextDeadline());
+
+	while (ros::ok() && running) {
+		int ready = epoll_wait(epoll_fd, events, CMD_EPOLL_EVENTS, -1);
+		if (ready < 0) {
+			if (errno != EINTR) ROS_ERROR("epoll_wait failed (errno: %d)", errno);
+			continue;
+		}
+
+		for (int e = 0; e < ready; ++e) {
+			if (events[e].data.fd == cmd_fd) handlePackets(executeCommand);
+			else if (events[e].data.fd == timer_fd) handleTimer(executeCommand);
+			else if (events[e].data.fd == stop_fd) break;
+			else callback_queue.callPending();
+		}
+	}
+}
+
+/**
+ * Parse all the datagrams of a batch.
+ */
+void PikopterCmd::handlePackets(ExecuteCommand &executeCommand) {
+	int received = receiveBatch();
+
+	if (received < 0) {
+		if (errno != EAGAIN) ROS_ERROR("Receiving command failed (errno: %d)", errno);
+		return;
+	}
+
+	// The timer is not moved for each batch, it checks this when it expires
+	int64_t now = monotonicNow();
+
+	for (int k = 0; k < received; ++k) {
+
+		// The emergency skips every filter: age, sequence, duplicates and arbitration
+		if (containsEmergency(packet(k), packetLength(k))) executeCommand.emergency(packetReceived(k));
+
+		if (packetAge(k) > max_age) {
+			++stats.dropped_too_old;
+			continue;
+		}
+
+		// The end of a truncated datagram is lost, its last command would be cut
+		if (packetTruncated(k)) {
+			++stats.dropped_truncated;
+			continue;
+		}
+
+		struct cmd_client &client = packetClient(k, now);
+		arbitrate(client, now);
+
+		parseCommand(packet(k), packetLength(k), packetReceived(k), client, stats, scheduler, executeCommand);
+
+		// The session took the free control with a control command of this datagram
+		if (client.pilot && pilot != &client) {
+			pilot = &client;
+			ROS_INFO("Session %s:%d controls the drone", inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port));
+		}
+
+		// Only the datagrams of the pilot feed the watchdog, an observer never holds off the landing
+		if (client.pilot) {
+			last_received = now;
+			watchdog_armed = true;
+			if (link_state != LINK_STATE_OK) {
+				ROS_WARN("Command link recovered");
+				link_state = LINK_STATE_OK;
+				executeCommand.linkState(link_state);
+			}
+		}
+	}
+
+	// The strings of the commands point into the packet slots, run them before the next batch
+	scheduler.drain(stats, executeCommand);
+}
+
+/**
+ * A deadline is reached: check the watchdog, ping the client if nothing has been
+ * received nor sent since a ping period, then wait for the next deadline.
+ */
+void PikopterCmd::handleTimer(ExecuteCommand &executeCommand) {
+	uint64_t expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0) return;
+
+	int64_t now = monotonicNow();
+
+	checkWatchdog(executeCommand, now);
+
+	// We should send ping again... for server
+	pingSessions(now);
+	evictSessions(now);
+
+	armTimer(nextDeadline());
+}
+
+/**
+ * Link-loss watchdog.
+ * After watchdog_hover of silence the drone hovers (zero velocity), a running trajectory
+ * goes on; after watchdog_land it lands, the trajectory is aborted.
+ * The time between the deadline and its detection is measured.
+ */
+void PikopterCmd::checkWatchdog(ExecuteCommand &executeCommand, int64_t now) {
+	if (!watchdog_armed) return;
+
+	int64_t deadline;
+	if (link_state == LINK_STATE_OK) deadline = last_received + watchdog_hover;
+	else if (link_state == LINK_STATE_WATCHDOG) deadline = last_received + watchdog_land;
+	else return;
+
+	if (now < deadline) return;
+
+	int64_t latency = now - deadline;
+	watchdog_latency_max = std::max(watchdog_latency_max, latency);
+	watchdog_latency_sum += latency;
+	++watchdog_triggers;
+
+	if (link_state == LINK_STATE_OK) {
+		ROS_WARN("No command since %ldms, hovering (detected %.3fms late)", (long)(watchdog_hover / 1000000LL), latency / 1e6);
+		link_state = LINK_STATE_WATCHDOG;
+		executeCommand.watchdogHover();
+	}
+	else {
+		ROS_ERROR("No command since %ldms, landing (detected %.3fms late)", (long)(watchdog_land / 1000000LL), latency / 1e6);
+		link_state = LINK_STATE_LOST;
+		watchdog_armed = false;
+		executeCommand.land();
+	}
+
+	executeCommand.linkState(link_state);
+}
+
+/**
+ * Earliest deadline among the ping and the next step of the watchdog.
+ */
+int64_t PikopterCmd::nextDeadline() {
+	int64_t deadline = monotonicNow() + ping_period;
+
+	// Next ping of the sessions
+	for (int k = 0; k < CMD_MAX_CLIENTS; ++k) {
+		if (clients[k].active)
+			deadline = std::min(deadline, std::max(clients[k].last_received, clients[k].last_ping) + ping_period);
+	}
+
+	if (watchdog_armed) {
+		if (link_state == LINK_STATE_OK) deadline = std::min(deadline, last_received + watchdog_hover);
+		else if (link_state == LINK_STATE_WATCHDOG) deadline = std::min(deadline, last_received + watchdog_land);
+	}
+
+	return deadline;
+}
+
+/**
+ * Program the timer for an absolute monotonic deadline (ns).
+ */
+void PikopterCmd::armTimer(int64_t deadline) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = deadline / 1000000000LL;
+	spec.it_value.tv_nsec = deadline % 1000000000LL;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+		ROS_ERROR("Unable to arm the timer of the cmd node (errno: %d)", errno);
+}
+
+/**
+ * Drain, without blocking, all the datagrams already queued in the socket
+ * (up to batch_size) with one syscall.
+ * Each packet is null terminated in its slot, so no memset of the slots is needed.
+ * Each slot keeps the source address of its packet, which gives its session;
+ * the pings go to the address of each session, the pilot's one included.
+ * Return the number of datagrams received, or -1 with errno set.
+ */
+int PikopterCmd::receiveBatch() {
+
+	// The kernel overwrites the name and control lengths, so they have to be given again
+	for (int k = 0; k < batch_size; ++k) {
+		batch_msgs[k].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		batch_msgs[k].msg_hdr.msg_controllen = sizeof(batch_controls[k]);
+	}
+
+	int received = recvmmsg(cmd_fd, batch_msgs, batch_size, MSG_DONTWAIT, NULL);
+	if (received <= 0) return received;
+
+	for (int k = 0; k < received; ++k)
+		batch_buffers[k][batch_msgs[k].msg_len] = '\0';
+
+	// The receive timestamps are on the realtime clock, which NTP can step
+	int64_t offset = realtimeNow() - monotonicNow();
+	clock_stepped = clock_offset != 0 && llabs(offset - clock_offset) > (int64_t) CMD_CLOCK_STEP_MS * 1000000LL;
+	clock_offset = offset;
+
+	// Update the statistics
+	++batch_histogram[received];
+	++batch_wakeups;
+	batch_packets += received;
+
+	if (batch_wakeups % CMD_BATCH_STATS_PERIOD == 0) displayBatchStats();
+
+	return received;
+}
+
+/**
+ * Get the null terminated content of a packet slot filled by the last receiveBatch().
+ */
+char *PikopterCmd::packet(int index) {
+	return (char *) batch_buffers[index];
+}
+
+/**
+ * Get the length of a packet slot filled by the last receiveBatch().
+ */
+int PikopterCmd::packetLength(int index) {
+	return (int) batch_msgs[index].msg_len;
+}
+
+/**
+ * Tell whether a packet filled by the last receiveBatch() was larger than its slot.
+ */
+bool PikopterCmd::packetTruncated(int index) {
+	return (batch_msgs[index].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+}
+
+/**
+ * Get the kernel receive timestamp of a packet.
+ * Return the time in nanoseconds (CLOCK_REALTIME), 0 if the packet has no timestamp.
+ */
+int64_t PikopterCmd::packetReceived(int index) {
+	struct msghdr &hdr = batch_msgs[index].msg_hdr;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec received;
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+			return (int64_t) received.tv_sec * 1000000000LL + received.tv_nsec;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Get the time spent by a packet in the socket, from its kernel receive timestamp.
+ * Return the age in nanoseconds, -1 if the packet has no timestamp. A negative age or
+ * a batch received across a step of the realtime clock gives 0, the packet is kept.
+ */
+int64_t PikopterCmd::packetAge(int index) {
+	int64_t received = packetReceived(index);
+	if (received == 0) return -1;
+
+	int64_t age = realtimeNow() - received;
+	if (age < 0 || clock_stepped) {
+		++stats.clock_steps;
+		return 0;
+	}
+	return age;
+}
+
+/**
+ * Get the session of the client which sent a packet, index -1 gives the station of the ip parameter.
+ * An unknown client takes a free entry, or the entry of the session heard the longest time ago
+ * which is neither the station nor the pilot.
+ */
+struct cmd_client &PikopterCmd::packetClient(int index, int64_t now) {
+	const struct sockaddr_in &addr = (index < 0) ? addr_drone_cmd : batch_addrs[index];
+	int oldest = -1;
+
+	for (int k = 0; k < CMD_MAX_CLIENTS; ++k) {
+		if (clients[k].active && clients[k].addr.sin_addr.s_addr == addr.sin_addr.s_addr && clients[k].addr.sin_port == addr.sin_port) {
+			clients[k].last_received = now;
+			return clients[k];
+		}
+		if (clients[k].active && (clients[k].permanent || clients[k].pilot)) continue;
+		if (oldest < 0 || (clients[oldest].active && (!clients[k].active || clients[k].last_received < clients[oldest].last_received)))
+			oldest = k;
+	}
+
+	// Every entry is the station or the pilot, can only happen with CMD_MAX_CLIENTS < 3
+	if (oldest < 0) oldest = CMD_MAX_CLIENTS - 1;
+	if (&clients[oldest] == pilot) pilot = NULL;
+
+	ROS_INFO("New command session %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+	struct cmd_client &client = clients[oldest];
+	client.addr = addr;
+	client.active = true;
+	client.permanent = false;
+	client.pilot = false;
+	client.may_pilot = false;
+	client.last_seq = 0;
+	memset(&client.state, 0, sizeof(client.state));
+	client.last_received = now;
+	client.last_ping = now;
+	return client;
+}
+
+/**
+ * Arbitration between the sessions, done for each datagram before it is parsed.
+ * The pilot keeps the control while it speaks; after pilot_timeout of silence
+ * the control is released. An allowed session takes it with its next control
+ * command (see takesControl()), the others stay observers.
+ */
+void PikopterCmd::arbitrate(struct cmd_client &client, int64_t now) {
+	if (pilot && pilot != &client && now - pilot->last_received >= pilot_timeout) {
+		ROS_WARN("Pilot %s:%d silent, control released", inet_ntoa(pilot->addr.sin_addr), ntohs(pilot->addr.sin_port));
+		pilot->pilot = false;
+		pilot = NULL;
+	}
+
+	client.may_pilot = !pilot && (pilot_addr == htonl(INADDR_ANY) || client.addr.sin_addr.s_addr == pilot_addr);
+}
+
+/**
+ * Ping each session silent for a ping period, nothing received from it nor sent to it.
+ */
+void PikopterCmd::pingSessions(int64_t now) {
+	for (int k = 0; k < CMD_MAX_CLIENTS; ++k) {
+		if (!clients[k].active) continue;
+		if (now - std::max(clients[k].last_received, clients[k].last_ping) < ping_period) continue;
+
+		ping(clients[k]);
+		clients[k].last_ping = now;
+	}
+}
+
+/**
+ * Forget the sessions silent for session_timeout, except the station of the ip parameter.
+ */
+void PikopterCmd::evictSessions(int64_t now) {
+	for (int k = 0; k < CMD_MAX_CLIENTS; ++k) {
+		if (!clients[k].active || clients[k].permanent) continue;
+		if (now - clients[k].last_received < session_timeout) continue;
+
+		ROS_INFO("Command session %s:%d closed", inet_ntoa(clients[k].addr.sin_addr), ntohs(clients[k].addr.sin_port));
+		if (&clients[k] == pilot) pilot = NULL;
+		clients[k].active = false;
+		clients[k].pilot = false;
+	}
+}
+
+/**
+ * Send a 1 byte ping to a session.
+ */
+void PikopterCmd::ping(struct cmd_client &client) {
+	if (sendto(cmd_fd, "\0", 1, 0, (struct sockaddr*) &client.addr, sizeof(client.addr)) < 0) {
+		ROS_ERROR("%s", "sendto()");
+	}
+}
+
+/**
+ * Display all the counters of the node.
+ */
+void PikopterCmd::displayStats() {
+	displayBatchStats();
+	displayParserStats(stats);
+	scheduler.displayStats();
+	displayWatchdogStats();
+}
+
+/**
+ * Display the detection latency of the watchdog.
+ */
+void PikopterCmd::displayWatchdogStats() {
+	if (watchdog_triggers == 0) return;
+
+	ROS_INFO("Watchdog: %lu triggers, detection latency %.3fms mean, %.3fms worst",
+		watchdog_triggers, watchdog_latency_sum / 1e6 / watchdog_triggers, watchdog_latency_max / 1e6);
+}
+
+/**
+ * Display the mean number of packets drained per wakeup and its distribution.
+ */
+void PikopterCmd::displayBatchStats() {
+	if (batch_wakeups == 0) return;
+
+	ROS_INFO("Command batches: %lu packets in %lu wakeups (%.2f per wakeup)",
+		batch_packets, batch_wakeups, (double) batch_packets / batch_wakeups);
+
+	for (int k = 1; k <= batch_size; ++k) {
+		if (batch_histogram[k])
+			ROS_DEBUG("\t %2d packets : %lu wakeups", k, batch_histogram[k]);
+	}
+}
+
+/**
+ * Read the parameters of the node, shared by the standalone node and the nodelet.
+ * Return false if the ip address is missing.
+ */
+bool PikopterCmd::readParams(ros::NodeHandle &cmd_private_nh, struct cmd_params &params) {
+	if(!cmd_private_nh.getParam("ip", params.ip)) {
+		ROS_FATAL("Missing ip parameter");
+		return false;
+	}
+
+	// Number of datagrams drained per wakeup (1 to get one packet per spin)
+	cmd_private_nh.param("batch_size", params.batch_size, CMD_BATCH_SIZE);
+
+	// Maximum time spent by a datagram in the socket before being parsed
+	cmd_private_nh.param("max_command_age_ms", params.max_age_ms, CMD_MAX_AGE_MS);
+
+	// Silence after which the client is pinged
+	cmd_private_nh.param("ping_period_ms", params.ping_period_ms, CMD_PING_PERIOD_MS);
+
+	// Silences after which the drone hovers, then lands
+	cmd_private_nh.param("watchdog_hover_ms", params.hover_ms, CMD_WATCHDOG_HOVER_MS);
+	cmd_private_nh.param("watchdog_land_ms", params.land_ms, CMD_WATCHDOG_LAND_MS);
+
+	// Arbitration: only this address can pilot (empty for the first client flying), and its silence releasing the control
+	cmd_private_nh.param("pilot_ip", params.pilot_ip, std::string(""));
+	cmd_private_nh.param("pilot_timeout_ms", params.pilot_timeout_ms, CMD_PILOT_TIMEOUT_MS);
+
+	return true;
+}
+
+
+#ifndef PIKOPTER_NO_MAIN
+/*!
+ * \brief Launcher of Ros node cmd
+ * The same node can be loaded in a nodelet manager, see pikopter_nodelets.cpp:
+ * the nodelet library builds this file with PIKOPTER_NO_MAIN defined.
+ *
+ * \param argc Number of parameters
+ * \param argv The arguments
+ *
+ */
+int main(int argc, char *argv[]) {
+	// Initialize ros for this node
+	ros::init(argc, argv, "pikopter_cmd");
+
+	// Create a node handle (fully initialize ros)
+	ros::NodeHandle cmd_node_handle;
+
+	ros::NodeHandle cmd_private_nh("~");
+
+	struct cmd_params params;
+	if (!PikopterCmd::readParams(cmd_private_nh, params)) return ERROR_ENCOUNTERED;
+
+	char* cstr = new char[params.ip.length() + 1];
+	strcpy(cstr, params.ip.c_str());
+
+	ros::start();
+
+  	ROS_INFO("Adresse ip : %s", cstr);
+
+	// Instance of PikopterCmd class, opens the UDP port for the cmd node
+	PikopterCmd pik(cstr, params.batch_size, params.max_age_ms, params.ping_period_ms, params.hover_ms, params.land_ms,
+		params.pilot_ip.c_str(), params.pilot_timeout_ms);
+	delete [] cstr;
+	if (!pik.ready()) return ERROR_ENCOUNTERED;
+
+	// The callbacks of the node wake up the event loop
+	EventfdCallbackQueue callback_queue;
+	ExecuteCommand executeCommand(cmd_node_handle, cmd_private_nh, &callback_queue);
+	if (!executeCommand.ready() || !pik.watch(callback_queue)) return ERROR_ENCOUNTERED;
+
+	// ROS LOOP
+	pik.run(executeCommand, callback_queue);
 
-	// close UDP socket
-	close(comfd);
+	pik.displayStats();
 
 	ros::shutdown();
 	return NO_ERROR_ENCOUNTERED;
 }
+#endif
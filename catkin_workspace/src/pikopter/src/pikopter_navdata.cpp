@@ -2,30 +2,82 @@
 #include "../include/pikopter/pikopter_navdata.h"
 
 
+/*!
+ * \brief Get the monotonic time in nanoseconds
+ */
+static uint64_t monotonicNs() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
 /*!
  * \brief Constructor of PikopterNavdata
  *
  * \param ip_adress The ip adress on which we create the udp socket
  * \param in_demo True if in demo mode, false if not
+ * \param node_handle The node handle advertising the topics of the node
  */
-PikopterNavdata::PikopterNavdata(char *ip_adress, bool in_demo) {
+PikopterNavdata::PikopterNavdata(char *ip_adress, bool in_demo, ros::NodeHandle &node_handle) {
+
+	// The sender thread is started later by startSender
+	sender_running = false;
+	timer_fd = -1;
+	push_timer_fd = -1;
+	epoll_fd = -1;
+	push_enabled = false;
 
 	// Open the UDP port for the navadata node
+	push_fd = -1;
 	navdata_fd = PikopterNetwork::open_udp_socket(PORT_NAVDATA, &addr_drone_navdata, ip_adress);
 	if (navdata_fd == ERROR_ENCOUNTERED) {
 		ROS_FATAL("Fatal error during the opening of the navdata socket");
-		ROS_FATAL("Fatal error code %d", navdata_fd);
-		exit(EXIT_FAILURE);
+		return;
+	}
+
+	// The callbacks can ask for a packet as soon as they are subscribed, the sender reads it once started
+	push_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (push_fd < 0) {
+		ROS_FATAL("Navdata can't create its push eventfd: %s", strerror(errno));
+		return;
 	}
 
+	// Other clients join by sending their wake-up to our navdata port
+	listening = (PikopterNetwork::bind_udp_socket(navdata_fd, PORT_NAVDATA) == NO_ERROR_ENCOUNTERED);
+	if (!listening) ROS_WARN("Navdata only sent to %s, the other clients can't join", ip_adress);
+
+	// The station given by the ip parameter always gets the navdata
+	for (int k = 0; k < NAVDATA_MAX_CLIENTS; k++) clients[k].active = false;
+	registerClient(addr_drone_navdata, 1, true, monotonicNs());
+	client_timeout_ns = (uint64_t)NAVDATA_CLIENT_TIMEOUT_MS * 1000000ULL;
+	periodic_ticks = 0;
+
 	// Put the mode
 	demo_mode = in_demo;
 
+	// The time option counts from the creation of the node
+	start_time_ns = monotonicNs();
+
 	// Initialise the navdata datas
 	initNavdata();
 
-	// Ask mavros the rate on which it wants to receive the datas
-	askMavrosRate();  // Will wait mavros to be launched before continuing the execution
+	// Ask mavros the rate on which it wants to receive the datas, in the background to send the navdata meanwhile
+	stream_rate_client.init(node_handle, "/mavros/set_stream_rate");
+	setup_thread = std::thread(&PikopterNavdata::askMavrosRate, this);
+
+	requested_period_ns = 1000000000LL / (in_demo ? NAVDATA_DEMO_LOOP_RATE : NAVDATA_LOOP_RATE);
+
+	// Publisher of the jitter histogram of the sender thread
+	jitter_pub = node_handle.advertise<std_msgs::UInt32MultiArray>("pikopter_navdata/send_jitter", PUB_BUF_SIZE_SEND_JITTER);
+
+	// Publisher of the rate really used, lowered when the link is congested
+	effective_rate_pub = node_handle.advertise<std_msgs::Float64>("pikopter_navdata/effective_rate", PUB_BUF_SIZE_EFFECTIVE_RATE, true);
+
+	// Only the sender adapts these
+	rate_scale = 1.0;
+	drop_low_priority = false;
 
 	// The other attributes got their memory allocated automatically
 }
@@ -36,13 +88,32 @@ PikopterNavdata::PikopterNavdata(char *ip_adress, bool in_demo) {
  */
 PikopterNavdata::~PikopterNavdata() {
 
+	// Stop sending before closing the socket
+	stopSender();
+	if (push_fd >= 0) close(push_fd);
+
+	// The stream rates may still be waiting for mavros
+	if (setup_thread.joinable()) setup_thread.join();
+	stream_rate_client.displayStats();
+
 	// Close the UDP socket
-	close(navdata_fd);
+	if (navdata_fd >= 0) close(navdata_fd);
 
 	// The other attributes got their memory deallocated automatically
 }
 
 
+/*!
+ * \brief Tell whether the constructor opened the socket
+ *
+ * \return True if the node can be started, false if not
+ */
+bool PikopterNavdata::isReady() {
+
+	return navdata_fd >= 0 && push_fd >= 0;
+}
+
+
 /*!
  * \brief Get the information about the mode used here
  *
@@ -56,21 +127,18 @@ bool PikopterNavdata::inDemoMode() {
 
 
 /*!
- * \brief Init the navdata buffer
+ * \brief Ask mavros the rates of the streams read by the navdata
+ *
+ * Runs on the setup thread: mavros may come up after us, the navdata is
+ * sent with its default values meanwhile.
  */
 void PikopterNavdata::askMavrosRate() {
 
-	// Check that the service does exist
-	if (!ros::service::exists("/mavros/set_stream_rate", true)) {  // Second paramter is whether we print the error or not
-		ROS_DEBUG("Can't put the stream rate for navdatas because /mavros/set_stream_rate service is unavailable. Maybe mavros isn't launched yet, we'll wait for it.");
-	}
-
 	// We'll wait for it then
-	bool mavros_available = ros::service::waitForService("/mavros/set_stream_rate", MAVROS_WAIT_TIMEOUT);
-	if (!mavros_available) {
-		ROS_FATAL("Mavros not launched, timeout of %dms reached, exiting...", MAVROS_WAIT_TIMEOUT);
-		delete this;
-		exit(ERROR_ENCOUNTERED);
+	std::vector<std::string> services(1, "/mavros/set_stream_rate");
+	if (PikopterNetwork::wait_for_services(services, MAVROS_WAIT_TIMEOUT) > 0) {
+		ROS_ERROR("Mavros not launched after %dms, its streams keep their default rates", MAVROS_WAIT_TIMEOUT);
+		return;
 	}
 
 	// Create a StreamRate service handler to call the request
@@ -87,30 +155,44 @@ void PikopterNavdata::askMavrosRate() {
 	sr_position.request.message_rate = SR_REQUEST_POSITION_RATE;
 	sr_position.request.on_off = SR_REQUEST_ON;
 
-	// Call the service for put rate to stream ext_status
-	if (ros::service::call("/mavros/set_stream_rate", sr_ext_status)) ROS_DEBUG("Mavros extended status rate asked") ;
+	// Call the service for put rate to stream ext_status, on the connection kept open
+	if (stream_rate_client.call(sr_ext_status)) ROS_DEBUG("Mavros extended status rate asked") ;
 	else ROS_ERROR("Call on set_stream_rate service for extended status failed");
 
 	// Call the service for put rate to stream position
-	if (ros::service::call("/mavros/set_stream_rate", sr_position)) ROS_DEBUG("Mavros position rate asked") ;
+	if (stream_rate_client.call(sr_position)) ROS_DEBUG("Mavros position rate asked") ;
 	else ROS_ERROR("Call on set_stream_rate service for position failed");
 
+	// The raw imu is only sent in full mode
+	if (!demo_mode) askMavrosRawSensors(true);
+
 }
 
 
 /*!
- * \brief Increment the sequence number of the navdata packet
+ * \brief Start or stop the raw sensors stream of mavros, only needed in full mode
+ *
+ * \param on True to stream the raw sensors, false to stop them
  */
-void PikopterNavdata::incrementSequenceNumber() {
+void PikopterNavdata::askMavrosRawSensors(bool on) {
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+	mavros_msgs::StreamRate sr_raw_sensors;
+	sr_raw_sensors.request.stream_id = mavros_msgs::StreamRateRequest::STREAM_RAW_SENSORS;
+	sr_raw_sensors.request.message_rate = SR_REQUEST_RAW_SENSORS_RATE;
+	sr_raw_sensors.request.on_off = on ? SR_REQUEST_ON : SR_REQUEST_OFF;
+
+	if (stream_rate_client.call(sr_raw_sensors)) ROS_DEBUG("Mavros raw sensors %s", on ? "asked" : "stopped");
+	else ROS_ERROR("Call on set_stream_rate service for raw sensors failed");
+}
 
-	// Increment the sequence number
-	++navdata_current.demo.sequence;
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+/*!
+ * \brief Increment the sequence number of the navdata packet
+ */
+void PikopterNavdata::incrementSequenceNumber() {
+
+	// Only the sender uses it, no need to go through the seqlock
+	++navdata_sequence;
 
 }
 
@@ -120,27 +202,48 @@ void PikopterNavdata::incrementSequenceNumber() {
  */
 void PikopterNavdata::initNavdata() {
 
+	// The sequence number belongs to the sender
+	navdata_sequence = DEFAULT_NAVDATA_DEMO_SEQUENCE;  // Not done into pikopter server
+	cmd_ack_requested_ns = 0;
+	ack_bit_sent = false;
+	ack_count = 0;
+	ack_latency_sum_ns = 0;
+	ack_latency_max_ns = 0;
+
 	// We fill the current navdata
-	navdata_current.demo.tag = TAG_DEMO;
-	navdata_current.demo.header = DEFAULT_NAVDATA_DEMO_HEADER;  // Not done into pikopter server
-	navdata_current.demo.sequence = DEFAULT_NAVDATA_DEMO_SEQUENCE;  // Not done into pikopter server
-	navdata_current.demo.size = PACKET_SIZE;  // Not done in the pikopter server
-	navdata_current.demo.vbat_flying_percentage = DEFAULT_NAVDATA_DEMO_VBAT_FLYING_PERCENTAGE;
-	navdata_current.demo.altitude = DEFAULT_NAVDATA_DEMO_ALTITUDE;
-	navdata_current.demo.theta = DEFAULT_NAVDATA_DEMO_THETA;
-	navdata_current.demo.phi = DEFAULT_NAVDATA_DEMO_PHI;
-	navdata_current.demo.psi = DEFAULT_NAVDATA_DEMO_PSI;
-	navdata_current.demo.vx = DEFAULT_NAVDATA_DEMO_VX;
-	navdata_current.demo.vy = DEFAULT_NAVDATA_DEMO_VY;
-	navdata_current.demo.vz = DEFAULT_NAVDATA_DEMO_VZ;
-	navdata_current.demo.vision_defined = DEFAULT_NAVDATA_DEMO_VISION;
-	navdata_current.demo.ctrl_state = DEFAULT;
-
-	// If in demo mode
-	if (demo_mode) navdata_current.demo.ardrone_state = DEFAULT_NAVDATA_DEMO_ARDRONE_STATE;  // Bit ARDRONE_NAVDATA_BOOTSTRAP to 1
-
-	// If in normal mode
-	else navdata_current.demo.ardrone_state = DEFAULT_NAVDATA_ARDRONE_STATE;
+	bool in_demo = demo_mode;
+	navdata_current.write([&](union navdata_t &navdata) {
+		memset(&navdata, 0, sizeof(navdata));
+		navdata.demo.tag = TAG_DEMO;
+		navdata.demo.header = DEFAULT_NAVDATA_DEMO_HEADER;  // Not done into pikopter server
+		navdata.demo.size = PACKET_SIZE;  // Not done in the pikopter server
+		navdata.demo.vbat_flying_percentage = DEFAULT_NAVDATA_DEMO_VBAT_FLYING_PERCENTAGE;
+		navdata.demo.altitude = DEFAULT_NAVDATA_DEMO_ALTITUDE;
+		navdata.demo.theta = DEFAULT_NAVDATA_DEMO_THETA;
+		navdata.demo.phi = DEFAULT_NAVDATA_DEMO_PHI;
+		navdata.demo.psi = DEFAULT_NAVDATA_DEMO_PSI;
+		navdata.demo.vx = DEFAULT_NAVDATA_DEMO_VX;
+		navdata.demo.vy = DEFAULT_NAVDATA_DEMO_VY;
+		navdata.demo.vz = DEFAULT_NAVDATA_DEMO_VZ;
+		navdata.demo.vision_defined = DEFAULT_NAVDATA_DEMO_VISION;
+		navdata.demo.ctrl_state = DEFAULT;
+
+		// If in demo mode
+		if (in_demo) navdata.demo.ardrone_state = DEFAULT_NAVDATA_DEMO_ARDRONE_STATE;  // Bit ARDRONE_NAVDATA_BOOTSTRAP to 1
+
+		// If in normal mode
+		else navdata.demo.ardrone_state = DEFAULT_NAVDATA_ARDRONE_STATE;
+	});
+
+	// Nothing received yet for the full mode
+	sensors_current.write([](struct navdata_sensors &sensors) {
+		memset(&sensors, 0, sizeof(sensors));
+	});
+
+	// No trajectory uploaded yet (TRAJECTORY_IDLE)
+	trajectory_current.write([](struct navdata_trajectory_option &trajectory) {
+		memset(&trajectory, 0, sizeof(trajectory));
+	});
 
 	ROS_DEBUG("Navdata demo datas initialized to default values");
 
@@ -157,10 +260,10 @@ void PikopterNavdata::setBitEndOfBootstrap() {
 
 	ROS_DEBUG("Bootstrap process has ended. Now ready to send navdatas.");
 
-	// No critical section because it's still sequential until here
-
 	// Put the bit into the bitmask
-	navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state & 0xFFFFF3FF;  // Bit ARDRONE_NAVDATA_BOOTSTRAP to 0
+	navdata_current.write([](union navdata_t &navdata) {
+		navdata.demo.ardrone_state = navdata.demo.ardrone_state & 0xFFFFF3FF;  // Bit ARDRONE_NAVDATA_BOOTSTRAP to 0
+	});
 
 }
 
@@ -168,242 +271,846 @@ void PikopterNavdata::setBitEndOfBootstrap() {
 /*!
  * \brief Send the navdata
  */
-void PikopterNavdata::sendNavdata() {
+bool PikopterNavdata::sendNavdata(bool periodic) {
+
+	// A command received since the last packet is owed to every client, a client
+	// skipped by its divisor gets the acknowledgment bit in its next packet
+	uint64_t ack_requested_ns = cmd_ack_requested_ns.exchange(0);
+	if (ack_requested_ns != 0) {
+
+		// Time the command waited for its acknowledgment
+		uint64_t latency_ns = monotonicNs() - ack_requested_ns;
+		ack_count++;
+		ack_latency_sum_ns += latency_ns;
+		if (latency_ns > ack_latency_max_ns) ack_latency_max_ns = latency_ns;
+
+		for (int k = 0; k < NAVDATA_MAX_CLIENTS; k++)
+			if (clients[k].active) clients[k].ack_owed = true;
+	}
+
+	// One message per client due, all of them pointing to the same packet
+	unsigned int nb_msgs = 0;
+	bool ack = false;
+	for (int k = 0; k < NAVDATA_MAX_CLIENTS; k++) {
+
+		// Pushed packets go to everybody, periodic ones follow the divisor of the client
+		if (!clients[k].active) continue;
+		if (periodic && periodic_ticks % clients[k].divisor != 0) continue;
+
+		// The packet carries the bit as long as one of its clients is owed it
+		if (clients[k].ack_owed) ack = true;
+		clients[k].ack_owed = false;
+
+		struct msghdr &header = fanout_msgs[nb_msgs].msg_hdr;
+		memset(&header, 0, sizeof(header));
+		header.msg_name = &clients[k].addr;
+		header.msg_namelen = sizeof(clients[k].addr);
+		header.msg_iov = &fanout_iovec;
+		header.msg_iovlen = 1;
+		nb_msgs++;
+	}
+
+	// Nobody to send to on this tick
+	if (nb_msgs == 0) return false;
 
 	// Temporary buffer to send the navdata
-	unsigned char tmp_buff[PACKET_SIZE];
+	union navdata_t tmp_buff;
+
+	// Consistent copy of the navdata, never waits for the callbacks
+	navdata_current.read(tmp_buff);
 
+	// Put the sequence number
+	tmp_buff.demo.sequence = navdata_sequence;
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+	// Put the acknowledgment bit if a command has been received since the last packet of a client
+	if (ack) tmp_buff.demo.ardrone_state = tmp_buff.demo.ardrone_state | 0x20;
+	ack_bit_sent = ack;
 
-	// Copy the content of the navdata buffer
-	memcpy(tmp_buff, (void *)&navdata_current, PACKET_SIZE);
+	// Write the wire format, only the populated options
+	size_t length = serializePacket(tmp_buff, !demo_mode);
+
+	// Send it to all the clients at once, never wait for room in the socket
+	fanout_iovec.iov_base = send_buffer;
+	fanout_iovec.iov_len = length;
+	// sendmmsg stops at the first message that fails, the next call returns its error
+	bool congested = false;
+	unsigned int first = 0;
+	while (first < nb_msgs) {
+
+		int sent = sendmmsg(navdata_fd, fanout_msgs + first, nb_msgs - first, MSG_DONTWAIT);
+		if (sent > 0) {
+			first += sent;
+			continue;
+		}
+		if (sent < 0 && errno == EINTR) continue;
 
-	// Put the acknowledgment bit back to 0
-	navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state & 0xFFFFFFDF;
+		// The link can't keep up, the packet of this client is lost
+		if (sent < 0 && (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK)) {
+			congested = true;
+			congestion_drops++;
+		}
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+		// A client gone or unreachable doesn't deprive the others of their packet
+		else {
+			const struct sockaddr_in *addr = (const struct sockaddr_in *)fanout_msgs[first].msg_hdr.msg_name;
+			ROS_WARN_THROTTLE(1, "Send of navdata packet to %s:%d didn't work properly: %s",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), strerror(sent < 0 ? errno : EIO));
+		}
 
-	// Try to send the navdata
-	ssize_t sent_size = sendto(navdata_fd, tmp_buff, PACKET_SIZE, 0, (struct sockaddr*)&addr_drone_navdata, sizeof(addr_drone_navdata));
+		// Skip the failing message and go on with the next clients
+		first++;
+	}
 
-	// Display error if there's one
-	if (sent_size < 0) ROS_ERROR("Send of navdata packet didn't work properly");
+	// Packets still waiting in the socket also mean the link is saturated
+	int queued = 0;
+	if (ioctl(navdata_fd, SIOCOUTQ, &queued) == 0 && queued > NAVDATA_OUTQ_HIGH_BYTES) congested = true;
 
 	// Increment the sequence number
 	incrementSequenceNumber();  // Not done into pikopter server
 
+	return congested;
 }
 
 
 /*!
- * \brief Function called when a message is published on X node
+ * \brief Copy an option block at the end of the packet
+ *
+ * \param buffer The packet being written
+ * \param offset The current length of the packet, moved after the block
+ * \param option The block, its tag and size are filled here
+ * \param tag The tag of the block
  */
-void PikopterNavdata::getAltitude(const std_msgs::Float64::ConstPtr& msg)  {
+template<typename T>
+static void appendOption(uint8_t *buffer, size_t &offset, T &option, uint16_t tag) {
+
+	option.tag = tag;
+	option.size = sizeof(T);
+	memcpy(buffer + offset, &option, sizeof(T));
+	offset += sizeof(T);
+}
 
-	ROS_DEBUG("Entered altitude with value=%f", (float)msg->data);
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+/*!
+ * \brief Write a navdata packet into send_buffer
+ *
+ * The packet is the header followed by the demo option. In full mode the
+ * time, raw measures, altitude and gps options follow in the order of
+ * their tags, the raw measures and gps only once their topic has been
+ * received and while the link is not congested. The trajectory option
+ * follows in both modes once a trajectory has been uploaded. The checksum
+ * option ends the packet.
+ *
+ * \param navdata The current navdata, with its sequence number and state already set
+ * \param full True to write the options of the full mode
+ *
+ * \return The length of the packet
+ */
+size_t PikopterNavdata::serializePacket(const union navdata_t &navdata, bool full) {
+
+	size_t offset = 0;
+
+	// Header
+	struct navdata_header header;
+	header.header = navdata.demo.header;
+	header.ardrone_state = navdata.demo.ardrone_state;
+	header.sequence = navdata.demo.sequence;
+	header.vision_defined = navdata.demo.vision_defined;
+	memcpy(send_buffer, &header, sizeof(header));
+	offset += sizeof(header);
+
+	// Demo option, same datas as the demo mode
+	struct navdata_demo_option demo;
+	memset(&demo, 0, sizeof(demo));
+	demo.ctrl_state = navdata.demo.ctrl_state;
+	demo.vbat_flying_percentage = navdata.demo.vbat_flying_percentage;
+	demo.theta = navdata.demo.theta;
+	demo.phi = navdata.demo.phi;
+	demo.psi = navdata.demo.psi;
+	demo.altitude = navdata.demo.altitude;
+	demo.vx = navdata.demo.vx;
+	demo.vy = navdata.demo.vy;
+	demo.vz = navdata.demo.vz;
+	appendOption(send_buffer, offset, demo, TAG_DEMO);
+
+	// Demo mode stops here
+	if (full) offset = serializeFullOptions(navdata, offset);
+
+	// Progress of the trajectory, the clients which don't know the tag skip it
+	struct navdata_trajectory_option trajectory;
+	trajectory_current.read(trajectory);
+	if (trajectory.state != TRAJECTORY_IDLE) appendOption(send_buffer, offset, trajectory, TAG_TRAJECTORY);
+
+	// Checksum option, the sum of all the bytes written before
+	struct navdata_cks_option cks;
+	cks.cks = 0;
+	for (size_t i = 0; i < offset; i++) cks.cks += send_buffer[i];
+	appendOption(send_buffer, offset, cks, TAG_CKS);
+
+	return offset;
+}
 
-	navdata_current.demo.altitude = (int32_t)msg->data;
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+/*!
+ * \brief Write the options of the full mode after the demo option
+ *
+ * \param navdata The current navdata
+ * \param offset The length of the packet before these options
+ *
+ * \return The length of the packet after these options
+ */
+size_t PikopterNavdata::serializeFullOptions(const union navdata_t &navdata, size_t offset) {
+
+	// One consistent copy of the sensors
+	struct navdata_sensors sensors;
+	sensors_current.read(sensors);
+
+	// Time option
+	uint64_t elapsed_us = (monotonicNs() - start_time_ns) / 1000;
+	struct navdata_time_option time;
+	time.time = ((uint32_t)(elapsed_us / 1000000) << 21) | (uint32_t)(elapsed_us % 1000000);
+	appendOption(send_buffer, offset, time, TAG_TIME);
+
+	// Raw measures option, dropped first when the link is congested
+	if (sensors.imu_defined && !drop_low_priority) {
+		struct navdata_raw_measures_option raw;
+		memset(&raw, 0, sizeof(raw));
+		for (int i = 0; i < 3; i++) {
+			raw.raw_accs[i] = (uint16_t)(int16_t)(sensors.acc[i] * NAVDATA_RAW_ACC_SCALE);
+			raw.raw_gyros[i] = (int16_t)(sensors.gyro[i] * NAVDATA_RAW_GYRO_SCALE);
+		}
+		raw.vbat_raw = sensors.vbat_raw;
+		appendOption(send_buffer, offset, raw, TAG_RAW_MEASURES);
+	}
+
+	// Altitude option
+	struct navdata_altitude_option altitude;
+	memset(&altitude, 0, sizeof(altitude));
+	altitude.altitude_vision = navdata.demo.altitude;
+	altitude.altitude_vz = navdata.demo.vz;
+	altitude.altitude_raw = navdata.demo.altitude;
+	altitude.obs_alt = (float32_t)navdata.demo.altitude;
+	appendOption(send_buffer, offset, altitude, TAG_ALTITUDE);
+
+	// Gps option, dropped first when the link is congested
+	if (sensors.gps_defined && !drop_low_priority) {
+		struct navdata_gps_option gps;
+		memset(&gps, 0, sizeof(gps));
+		gps.latitude = sensors.latitude;
+		gps.longitude = sensors.longitude;
+		gps.elevation = sensors.elevation;
+		gps.data_available = 1;
+		appendOption(send_buffer, offset, gps, TAG_GPS);
+	}
+
+	return offset;
 }
 
 
 /*!
- * \brief Function called when a message is published on X node
+ * \brief Start the thread sending the navdata at the given rate
+ *
+ * The thread is woken by a timerfd armed on absolute deadlines, so the
+ * time spent sending never shifts the next packet.
+ *
+ * The periodic stream is the floor rate. With event_push, important
+ * changes of the state also send a packet at once, never closer than
+ * push_spacing_ms to the previous one.
+ *
+ * \param rate The number of packets per second
+ * \param fifo_priority The SCHED_FIFO priority of the thread, 0 to keep the default policy
+ * \param event_push True to send a packet as soon as an important bit changes
+ * \param push_spacing_ms The minimum time between a pushed packet and the previous one
+ * \param client_timeout_ms The time after which a silent client is forgotten, 0 to keep them
+ *
+ * \return True if the thread is started, false if its timers could not be created
  */
-void PikopterNavdata::display() {
+bool PikopterNavdata::startSender(int rate, int fifo_priority, bool event_push, int push_spacing_ms, int client_timeout_ms) {
+
+	// Reset the jitter statistics
+	memset(jitter_histogram, 0, sizeof(jitter_histogram));
+	jitter_missed = 0;
+	jitter_max_ns = 0;
+	last_send_ns = 0;
+
+	// Create the timer
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		ROS_FATAL("Navdata can't create its timer: %s", strerror(errno));
+		return false;
+	}
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+	// First deadline one period from now, then every period
+	requested_period_ns = 1000000000LL / rate;
+	if (!armTimer(requested_period_ns)) {
+		stopSender();
+		return false;
+	}
 
-	// Just get the current sequence number
-	int sequence = navdata_current.demo.sequence;
+	// One shot timer for the pushes delayed by the minimum spacing
+	push_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (push_timer_fd < 0) {
+		ROS_FATAL("Navdata can't create its push timer: %s", strerror(errno));
+		stopSender();
+		return false;
+	}
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+	// The sender waits on the timers, the push requests and the wake-ups of the clients
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		ROS_FATAL("Navdata can't create its epoll instance: %s", strerror(errno));
+		stopSender();
+		return false;
+	}
+	int fds[] = { timer_fd, push_fd, push_timer_fd, navdata_fd };
+	for (int fd : fds) {
+		if (fd == navdata_fd && !listening) continue;
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			ROS_FATAL("Navdata can't watch its timers: %s", strerror(errno));
+			stopSender();
+			return false;
+		}
+	}
 
-	// Only if the wanted display rate
-	if (sequence%NAVDATA_DISPLAY_RATE == 0) {
+	// Silent clients
+	client_timeout_ns = (uint64_t)client_timeout_ms * 1000000ULL;
+
+	// Nominal rate until the link gets congested
+	rate_scale = 1.0;
+	drop_low_priority = false;
+	last_rate_change_ns = 0;
+	last_congestion_ns = 0;
+	congestion_drops = 0;
+
+	// Pushes
+	push_pending = false;
+	push_critical = false;
+	push_critical_pending = false;
+	push_spacing_ns = (uint64_t)push_spacing_ms * 1000000ULL;
+	last_packet_ns = 0;
+	pushed_packets = 0;
+	coalesced_pushes = 0;
+	push_enabled = event_push;
+
+	// Launch the thread
+	sender_running = true;
+	sender_thread = std::thread(&PikopterNavdata::senderLoop, this);
+
+	// Put it in real time if asked, it is not fatal if we don't have the right to
+	if (fifo_priority > 0) {
+		struct sched_param param;
+		param.sched_priority = fifo_priority;
+		int err = pthread_setschedparam(sender_thread.native_handle(), SCHED_FIFO, &param);
+		if (err != 0) ROS_WARN("Navdata sender keeps the default policy, SCHED_FIFO %d refused: %s", fifo_priority, strerror(err));
+		else ROS_INFO("Navdata sender running with SCHED_FIFO priority %d", fifo_priority);
+	}
 
-		ROS_DEBUG("Current state of the Navdata:");
+	ROS_DEBUG("Navdata sender started with a period of %ld ns", (long)send_period_ns);
+	return true;
+}
 
-		/* ##### Enter Critical Section ##### */
-		navdata_mutex.lock();
 
-		ROS_DEBUG("\n");
-		ROS_DEBUG("Navdata number %d\n", navdata_current.demo.sequence);
-		ROS_DEBUG("\t Header : %d\n", navdata_current.demo.header);
-		ROS_DEBUG("\t Tag : %d\n", navdata_current.demo.tag);
-		ROS_DEBUG("\t Mask : %d\n", navdata_current.demo.ardrone_state);
-		ROS_DEBUG("\t Sequence number : %d\n", navdata_current.demo.sequence);
-		ROS_DEBUG("\t Battery : %d\n", navdata_current.demo.vbat_flying_percentage);
-		ROS_DEBUG("\t Fly state: %x\n", navdata_current.demo.ctrl_state);
-		ROS_DEBUG("\t Altitude : %d\n", navdata_current.demo.altitude);
-		ROS_DEBUG("\t Theta : %f\n", navdata_current.demo.theta);
-		ROS_DEBUG("\t Phi : %f\n", navdata_current.demo.phi);
-		ROS_DEBUG("\t Psi : %f\n", navdata_current.demo.psi);
-		ROS_DEBUG("\t Vx : %f\n", navdata_current.demo.vx);
-		ROS_DEBUG("\t Vy : %f\n", navdata_current.demo.vy);
-		ROS_DEBUG("\t Vz : %f\n", navdata_current.demo.vz);
-		ROS_DEBUG("\n");
+/*!
+ * \brief Arm the sender timer on a new period
+ *
+ * The first deadline is one period from now, the next ones follow on
+ * absolute deadlines.
+ *
+ * \param period_ns The period between two packets
+ *
+ * \return True if the timer follows the new period, false if it keeps the previous one
+ */
+bool PikopterNavdata::armTimer(int64_t period_ns) {
+
+	uint64_t first = monotonicNs() + period_ns;
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = period_ns / 1000000000LL;
+	spec.it_interval.tv_nsec = period_ns % 1000000000LL;
+	spec.it_value.tv_sec = first / 1000000000ULL;
+	spec.it_value.tv_nsec = first % 1000000000ULL;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		ROS_FATAL("Navdata can't arm its timer: %s", strerror(errno));
+		return false;
+	}
+	send_period_ns = period_ns;
+
+	// The interval across the change is not jitter
+	last_send_ns = 0;
+
+	// Export the rate really used
+	std_msgs::Float64::Ptr msg = boost::make_shared<std_msgs::Float64>();
+	msg->data = 1000000000.0 / send_period_ns;
+	effective_rate_pub.publish(msg);
+	return true;
+}
+
 
-		/* ##### Exit Critical Section ##### */
-		navdata_mutex.unlock();
+/*!
+ * \brief Stop the sender thread and wait for it
+ */
+void PikopterNavdata::stopSender() {
+
+	// The thread exits at its next tick
+	push_enabled = false;
+	sender_running = false;
+	if (sender_thread.joinable()) sender_thread.join();
+
+	int *fds[] = { &timer_fd, &push_timer_fd, &epoll_fd };
+	for (int *fd : fds) {
+		if (*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
 	}
 }
 
 
 /*!
- * \brief Put the battery datas into the navdata
+ * \brief Body of the sender thread: wait the deadline, then send
  */
-void PikopterNavdata::handleBattery(const mavros_msgs::BatteryStatus::ConstPtr& msg) {
+void PikopterNavdata::senderLoop() {
 
-	// Get the value of the battery
-	int remaining_battery = (int)(msg->remaining * BATTERY_PERCENTAGE);
+	struct epoll_event events[NAVDATA_EPOLL_EVENTS];
+	uint32_t ticks = 0;
+	bool push_timer_armed = false;
 
-	ROS_DEBUG("Entered battery with value=%d", remaining_battery);
+	while (sender_running) {
+
+		// Block until the next deadline or a push
+		int nb_events = epoll_wait(epoll_fd, events, NAVDATA_EPOLL_EVENTS, -1);
+		if (nb_events < 0) {
+			if (errno == EINTR) continue;
+			ROS_ERROR("Navdata sender wait failed: %s", strerror(errno));
+			break;
+		}
+
+		bool tick = false;
+		bool push = false;
+
+		for (int i = 0; i < nb_events; i++) {
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+			// Wake-ups of the clients
+			if (events[i].data.fd == navdata_fd) {
+				receiveWakeups(monotonicNs());
+				continue;
+			}
 
-	// Put the correct battery status then
-	navdata_current.demo.vbat_flying_percentage = (uint32_t)remaining_battery;
+			// The value is the number of expirations or of requests since the last read
+			uint64_t value;
+			if (read(events[i].data.fd, &value, sizeof(value)) != sizeof(value)) continue;
 
-	// If acceptable battery level
-	if ((remaining_battery <= 100) && (remaining_battery > CRITICAL_BATTERY_LIMIT))
-		navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state & 0xFFFFFFDF;  // Bit ARDRONE_VBAT_LOW to 0
+			// Periodic deadline, measured against the previous one
+			if (events[i].data.fd == timer_fd) {
+				recordJitter(monotonicNs(), value);
+				periodic_ticks++;
+				tick = true;
+			}
 
-	// If critical level
-	else if ((remaining_battery > 0) && (remaining_battery <= CRITICAL_BATTERY_LIMIT))
-		navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 0x4000;  // Bit ARDRONE_VBAT_LOW to 1
+			// A callback asked for a packet, or a delayed push is due
+			else push_pending = true;
+		}
+
+		uint64_t now = monotonicNs();
+
+		// Under congestion only the critical changes leave the periodic stream, the others ride on the next tick
+		if (push_pending) push_critical_pending = push_critical.exchange(false) || push_critical_pending;
+		if (push_pending && !tick && !push_critical_pending && rate_scale < 1.0) {
+			push_pending = false;
+			coalesced_pushes++;
+		}
+
+		// Forget the clients which stopped asking
+		if (tick) evictClients(now);
+
+		// The periodic packet carries the change, otherwise push it if the spacing allows
+		if (push_pending && !tick) {
+			uint64_t earliest = last_packet_ns + push_spacing_ns;
+			if (now >= earliest) push = true;
+			else {
+				struct itimerspec spec;
+				memset(&spec, 0, sizeof(spec));
+				spec.it_value.tv_sec = earliest / 1000000000ULL;
+				spec.it_value.tv_nsec = earliest % 1000000000ULL;
+				timerfd_settime(push_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+				push_timer_armed = true;
+			}
+		}
 
-	// If incorrect value
-	else ROS_WARN("Incorrect value of the remaining battery: %d", remaining_battery);
+		if (tick || push) {
+
+			// Display the state of the navdata (for debug)
+			display();
+
+			// And then we send it
+			adaptRate(sendNavdata(tick), now);
+			last_packet_ns = now;
+			push_pending = false;
+			push_critical_pending = false;
+			if (push) pushed_packets++;
+
+			// The delayed push left with this packet, it would send a second one for nothing
+			if (push_timer_armed) {
+				struct itimerspec zero;
+				memset(&zero, 0, sizeof(zero));
+				timerfd_settime(push_timer_fd, 0, &zero, NULL);
+				push_timer_armed = false;
+			}
+		}
+
+		if (!tick) continue;
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+		// Publish the statistics from time to time
+		if (++ticks % NAVDATA_JITTER_PUBLISH_PERIOD == 0) {
+			publishJitter();
+			displayAckLatency();
+		}
 
+		// The mode or the congestion changed the rate, follow it from now on
+		int64_t period_ns = (int64_t)(requested_period_ns / rate_scale);
+		if (period_ns != send_period_ns && !armTimer(period_ns)) break;
+	}
 }
 
 
 /*!
- * \brief Get the state of the drone
+ * \brief Back off or recover the navdata rate after a send
+ *
+ * The rate is halved on congestion, at most once per holdoff, and raised
+ * by a step after each recovery period without congestion. Under half of
+ * the nominal rate the low priority options are dropped too.
+ *
+ * \param congested True if the last send met a saturated link
+ * \param now_ns The monotonic time of the send
  */
-void PikopterNavdata::getExtendedState(const mavros_msgs::ExtendedState::ConstPtr& msg) {
+void PikopterNavdata::adaptRate(bool congested, uint64_t now_ns) {
 
-	ROS_DEBUG("Correctly entered getExtendedState");
+	double previous = rate_scale;
 
-	// Check if we got strange states
-	if ((msg->vtol_state > 0) && (msg->landed_state > 0))
-		ROS_WARN("Strange state where the drone is considered as flying and landing at the same time. vtol_state = %d and landed_state = %d", msg->vtol_state, msg->landed_state);
-	else if ((msg->vtol_state == 0) && (msg->landed_state == 0))
-		ROS_WARN("Strange state where the drone is considered as not flying nor landing. vtol_state = %d and landed_state = %d", msg->vtol_state, msg->landed_state);
+	if (congested) {
+		last_congestion_ns = now_ns;
+		if (now_ns - last_rate_change_ns >= NAVDATA_BACKOFF_HOLDOFF_MS * 1000000ULL) {
+			rate_scale = std::max(rate_scale * NAVDATA_BACKOFF_FACTOR, NAVDATA_MIN_RATE_SCALE);
+			last_rate_change_ns = now_ns;
+		}
+	}
+	else if (rate_scale < 1.0
+			&& now_ns - last_congestion_ns >= NAVDATA_RECOVERY_PERIOD_MS * 1000000ULL
+			&& now_ns - last_rate_change_ns >= NAVDATA_RECOVERY_PERIOD_MS * 1000000ULL) {
+		rate_scale = rate_scale + NAVDATA_RECOVERY_STEP;
+		if (rate_scale > 1.0 - NAVDATA_RECOVERY_STEP / 2) rate_scale = 1.0;  // Steps don't sum exactly to 1
+		last_rate_change_ns = now_ns;
+	}
 
+	if (rate_scale == previous) return;
 
-	// Here the managment of the flying state
-	switch(msg->vtol_state) {
+	drop_low_priority = (rate_scale <= NAVDATA_DROP_OPTIONS_SCALE);
 
-		// Undefined state (this state can be used when the drone isn't flying but landed)
-		case mavros_msgs::ExtendedState::VTOL_STATE_UNDEFINED: {
-			// Nothing to do here I think
-		}
+	if (rate_scale < previous) ROS_WARN("Navdata link congested, rate scaled down to %.0f%%", rate_scale * 100);
+	else ROS_INFO("Navdata link clearing, rate scaled up to %.0f%%", rate_scale * 100);
+}
 
-		// When the drone is in transition forward
-		case mavros_msgs::ExtendedState::VTOL_STATE_TRANSITION_TO_FW: {
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+/*!
+ * \brief Read the wake-ups waiting in the socket and register their clients
+ *
+ * A wake-up is the usual datagram of a few bytes sent to the navdata port.
+ * When its second byte is not 0, the client only gets one periodic packet
+ * out of this value.
+ *
+ * \param now_ns The monotonic time of the reception
+ */
+void PikopterNavdata::receiveWakeups(uint64_t now_ns) {
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 1;  // Bit ARDRONE_FLY_MASK to 1
+	uint8_t wakeup[NAVDATA_WAKEUP_SIZE];
+	struct sockaddr_in addr;
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
+	while (true) {
+		socklen_t addr_len = sizeof(addr);
+		ssize_t size = recvfrom(navdata_fd, wakeup, sizeof(wakeup), MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr*)&addr, &addr_len);
+		if (size < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) ROS_ERROR("Navdata wake-up reception failed: %s", strerror(errno));
+			return;
 		}
 
-		// ???
-		case mavros_msgs::ExtendedState::VTOL_STATE_TRANSITION_TO_MC: {
+		// Anything bigger is not a wake-up, a navdata packet looped back for instance
+		if (size > NAVDATA_WAKEUP_SIZE) continue;
+
+		uint32_t divisor = (size >= 2 && wakeup[1] > 0) ? wakeup[1] : 1;
+		registerClient(addr, divisor, false, now_ns);
+	}
+}
+
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+/*!
+ * \brief Add a client or refresh it if already known
+ *
+ * When the registry is full, the client heard the longest time ago is
+ * replaced, never the permanent one.
+ *
+ * \param addr The address the navdata is sent to
+ * \param divisor The client gets one periodic packet out of divisor
+ * \param permanent True if the client is never evicted
+ * \param now_ns The monotonic time of the wake-up
+ */
+void PikopterNavdata::registerClient(const struct sockaddr_in &addr, uint32_t divisor, bool permanent, uint64_t now_ns) {
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 1;  // Bit ARDRONE_FLY_MASK to 1
+	int slot = -1;
+	for (int k = 0; k < NAVDATA_MAX_CLIENTS; k++) {
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
+		// Known client, only refresh it
+		if (clients[k].active && clients[k].addr.sin_addr.s_addr == addr.sin_addr.s_addr && clients[k].addr.sin_port == addr.sin_port) {
+			clients[k].last_seen_ns = now_ns;
+			clients[k].divisor = divisor;
+			return;
 		}
 
-		// ???
-		case mavros_msgs::ExtendedState::VTOL_STATE_MC: {
+		// Prefer a free slot, then the oldest client which can be evicted
+		if (clients[k].active && clients[k].permanent) continue;
+		if (slot < 0 || (clients[slot].active && (!clients[k].active || clients[k].last_seen_ns < clients[slot].last_seen_ns)))
+			slot = k;
+	}
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+	if (slot < 0) {
+		ROS_WARN("Navdata client %s:%d refused, no slot left", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+		return;
+	}
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 1;  // Bit ARDRONE_FLY_MASK to 1
+	if (clients[slot].active) ROS_WARN("Navdata client %s:%d replaced", inet_ntoa(clients[slot].addr.sin_addr), ntohs(clients[slot].addr.sin_port));
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
-		}
+	clients[slot].addr = addr;
+	clients[slot].active = true;
+	clients[slot].permanent = permanent;
+	clients[slot].divisor = divisor;
+	clients[slot].last_seen_ns = now_ns;
+	clients[slot].ack_owed = false;
+
+	ROS_INFO("Navdata client %s:%d joined, one packet out of %u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), divisor);
+}
 
-		// ???
-		case mavros_msgs::ExtendedState::VTOL_STATE_FW: {
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+/*!
+ * \brief Forget the clients which did not repeat their wake-up in time
+ *
+ * \param now_ns The current monotonic time
+ */
+void PikopterNavdata::evictClients(uint64_t now_ns) {
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 1;  // Bit ARDRONE_FLY_MASK to 1
+	if (client_timeout_ns == 0) return;
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
-		}
+	for (int k = 0; k < NAVDATA_MAX_CLIENTS; k++) {
+		if (!clients[k].active || clients[k].permanent) continue;
+		if (now_ns - clients[k].last_seen_ns < client_timeout_ns) continue;
+
+		clients[k].active = false;
+		ROS_INFO("Navdata client %s:%d left", inet_ntoa(clients[k].addr.sin_addr), ntohs(clients[k].addr.sin_port));
 	}
+}
 
 
-	// If landed
-	switch (msg->landed_state) {
+/*!
+ * \brief Ask the sender for a packet out of the periodic stream
+ *
+ * Called by the callbacks when an important bit of the state changes.
+ *
+ * \param critical True for a bit of NAVDATA_PUSH_STATE_MASK, pushed even when the link is congested
+ */
+void PikopterNavdata::requestPush(bool critical) {
 
-		// Undefined state (can be used when the drone isn't landed)
-		case mavros_msgs::ExtendedState::LANDED_STATE_UNDEFINED: {
-			// Nothing to do here I think
-		}
+	if (!push_enabled) return;
 
-		// Drone is landed on the ground (based on which altitude he took off)
-		case mavros_msgs::ExtendedState::LANDED_STATE_ON_GROUND: {
+	if (critical) push_critical = true;
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+	uint64_t one = 1;
+	if (write(push_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ROS_ERROR("Navdata push request failed: %s", strerror(errno));
+}
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state & 0xFFFFFFFE;  // Bit ARDRONE_FLY_MASK to 0
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
-		}
+/*!
+ * \brief Display the time the commands waited for their acknowledgment
+ */
+void PikopterNavdata::displayAckLatency() {
+
+	if (ack_count == 0) return;
+
+	ROS_DEBUG("Navdata ack latency: %u acks, mean %lu us, max %lu us, %u pushed packets, %u coalesced, %u dropped by congestion",
+		ack_count, (unsigned long)(ack_latency_sum_ns / ack_count / 1000), (unsigned long)(ack_latency_max_ns / 1000), pushed_packets, coalesced_pushes, congestion_drops);
+}
 
-		// Drone is landed "in the air" (higher than its take off based altitude)
-		case mavros_msgs::ExtendedState::LANDED_STATE_IN_AIR: {
 
-			/* ##### Enter Critical Section ##### */
-			navdata_mutex.lock();
+/*!
+ * \brief Put the interval since the last send into the jitter histogram
+ *
+ * \param now_ns The monotonic time of this send
+ * \param expirations The number of deadlines elapsed since the last wakeup
+ */
+void PikopterNavdata::recordJitter(uint64_t now_ns, uint64_t expirations) {
 
-			// Put the flying bit mask
-			navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state & 0xFFFFFFFE;  // Bit ARDRONE_FLY_MASK to 0
+	// Deadlines we slept through are packets that were never sent
+	if (expirations > 1) jitter_missed += expirations - 1;
 
-			/* ##### Exit Critical Section ##### */
-			navdata_mutex.unlock();
-		}
+	if (last_send_ns != 0) {
+
+		// Deviation from the expected interval, in either direction
+		int64_t deviation = (int64_t)(now_ns - last_send_ns) - (int64_t)expirations * send_period_ns;
+		if (deviation < 0) deviation = -deviation;
+		if (deviation > jitter_max_ns) jitter_max_ns = deviation;
+
+		uint64_t bin = deviation / (NAVDATA_JITTER_BIN_US * 1000);
+		if (bin >= NAVDATA_JITTER_BINS) bin = NAVDATA_JITTER_BINS - 1;
+		jitter_histogram[bin]++;
 	}
 
+	last_send_ns = now_ns;
+}
+
+
+/*!
+ * \brief Publish the jitter histogram of the sender
+ *
+ * The data holds one count per bin of NAVDATA_JITTER_BIN_US, then the
+ * number of missed deadlines.
+ */
+void PikopterNavdata::publishJitter() {
+
+	// Published as a shared pointer, the subscribers of the same process get it without a copy
+	std_msgs::UInt32MultiArray::Ptr msg = boost::make_shared<std_msgs::UInt32MultiArray>();
+	msg->data.assign(jitter_histogram, jitter_histogram + NAVDATA_JITTER_BINS);
+	msg->data.push_back(jitter_missed);
+	jitter_pub.publish(msg);
+
+	ROS_DEBUG("Navdata send jitter: max %ld us, %u missed deadlines", (long)(jitter_max_ns / 1000), jitter_missed);
+}
+
+
+/*!
+ * \brief Function called when a message is published on X node
+ */
+void PikopterNavdata::getAltitude(const std_msgs::Float64::ConstPtr& msg)  {
+
+	ROS_DEBUG("Entered altitude with value=%f", (float)msg->data);
+
+	/* ##### Publish through the seqlock ##### */
+	navdata_current.write([&](union navdata_t &navdata) {
+		navdata.demo.altitude = (int32_t)msg->data;
+	});
+}
+
+
+/*!
+ * \brief Function called when a message is published on X node
+ */
+void PikopterNavdata::display() {
+
+	// Just get the current sequence number (owned by the sender thread)
+	int sequence = navdata_sequence;
+
+	// Only if the wanted display rate
+	if (sequence%NAVDATA_DISPLAY_RATE == 0) {
+
+		ROS_DEBUG("Current state of the Navdata:");
+
+		// One consistent copy for the whole display
+		union navdata_t navdata;
+		navdata_current.read(navdata);
+
+		ROS_DEBUG("\n");
+		ROS_DEBUG("Navdata number %d\n", sequence);
+		ROS_DEBUG("\t Header : %d\n", navdata.demo.header);
+		ROS_DEBUG("\t Tag : %d\n", navdata.demo.tag);
+		ROS_DEBUG("\t Mask : %d\n", navdata.demo.ardrone_state);
+		ROS_DEBUG("\t Sequence number : %d\n", sequence);
+		ROS_DEBUG("\t Battery : %d\n", navdata.demo.vbat_flying_percentage);
+		ROS_DEBUG("\t Fly state: %x\n", navdata.demo.ctrl_state);
+		ROS_DEBUG("\t Altitude : %d\n", navdata.demo.altitude);
+		ROS_DEBUG("\t Theta : %f\n", navdata.demo.theta);
+		ROS_DEBUG("\t Phi : %f\n", navdata.demo.phi);
+		ROS_DEBUG("\t Psi : %f\n", navdata.demo.psi);
+		ROS_DEBUG("\t Vx : %f\n", navdata.demo.vx);
+		ROS_DEBUG("\t Vy : %f\n", navdata.demo.vy);
+		ROS_DEBUG("\t Vz : %f\n", navdata.demo.vz);
+		ROS_DEBUG("\n");
+	}
+}
+
+
+/*!
+ * \brief Put the battery datas into the navdata
+ */
+void PikopterNavdata::handleBattery(const mavros_msgs::BatteryStatus::ConstPtr& msg) {
+
+	// Get the value of the battery
+	int remaining_battery = (int)(msg->remaining * BATTERY_PERCENTAGE);
+
+	ROS_DEBUG("Entered battery with value=%d", remaining_battery);
+
+	// If incorrect value (logged outside of the write, readers retry while it lasts)
+	bool acceptable = (remaining_battery <= 100) && (remaining_battery > CRITICAL_BATTERY_LIMIT);
+	bool critical = (remaining_battery > 0) && (remaining_battery <= CRITICAL_BATTERY_LIMIT);
+	if (!acceptable && !critical) ROS_WARN("Incorrect value of the remaining battery: %d", remaining_battery);
+
+	/* ##### Publish through the seqlock ##### */
+	bool changed = false;
+	navdata_current.write([&](union navdata_t &navdata) {
+		uint32_t previous = navdata.demo.ardrone_state;
+
+		// Put the correct battery status then
+		navdata.demo.vbat_flying_percentage = (uint32_t)remaining_battery;
+
+		// If acceptable battery level
+		if (acceptable)
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state & ~ARDRONE_VBAT_LOW_MASK;  // Bit ARDRONE_VBAT_LOW to 0
+
+		// If critical level
+		else if (critical)
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state | ARDRONE_VBAT_LOW_MASK;  // Bit ARDRONE_VBAT_LOW to 1
+
+		changed = (navdata.demo.ardrone_state != previous);
+	});
+
+	// The client learns about a critical battery at once
+	if (changed) requestPush(true);
+
+	// The voltage goes into the raw measures of the full mode
+	sensors_current.write([&](struct navdata_sensors &sensors) {
+		sensors.vbat_raw = (uint32_t)(msg->voltage * 1000);
+	});
+
+}
+
+
+/*!
+ * \brief Get the state of the drone
+ */
+void PikopterNavdata::getExtendedState(const mavros_msgs::ExtendedState::ConstPtr& msg) {
+
+	ROS_DEBUG("Correctly entered getExtendedState");
+
+	// Check if we got strange states
+	if (msg->landed_state == mavros_msgs::ExtendedState::LANDED_STATE_UNDEFINED)
+		ROS_WARN("Strange state where the drone is considered as not flying nor landed. vtol_state = %d and landed_state = %d", msg->vtol_state, msg->landed_state);
+
+	// Flying as long as the drone is in the air, the vtol state only tells how it flies
+	bool flying = (msg->landed_state == mavros_msgs::ExtendedState::LANDED_STATE_IN_AIR);
+
+	/* ##### Publish through the seqlock ##### */
+	bool changed = false;
+	navdata_current.write([&](union navdata_t &navdata) {
+		uint32_t previous = navdata.demo.ardrone_state;
+
+		if (flying)
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state | ARDRONE_FLY_MASK;  // Bit ARDRONE_FLY_MASK to 1
+		else
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state & ~ARDRONE_FLY_MASK;  // Bit ARDRONE_FLY_MASK to 0
+
+		changed = (navdata.demo.ardrone_state != previous);
+	});
+
+	// The client learns about a takeoff or a landing at once
+	if (changed) requestPush(true);
+
 }
 
 
@@ -418,16 +1125,13 @@ void PikopterNavdata::handleVelocity(const geometry_msgs::TwistStamped::ConstPtr
 
 	ROS_DEBUG("Entered velocity with (x = %f, y = %f, z = %f)", msg->twist.linear.x, msg->twist.linear.y, msg->twist.linear.y);
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
-
-	// Updatas velocity datas
-	navdata_current.demo.vx = (float32_t)msg->twist.linear.x;
-	navdata_current.demo.vy = (float32_t)msg->twist.linear.y;
-	navdata_current.demo.vz = (float32_t)msg->twist.linear.z;
-
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+	/* ##### Publish through the seqlock ##### */
+	navdata_current.write([&](union navdata_t &navdata) {
+		// Updatas velocity datas
+		navdata.demo.vx = (float32_t)msg->twist.linear.x;
+		navdata.demo.vy = (float32_t)msg->twist.linear.y;
+		navdata.demo.vz = (float32_t)msg->twist.linear.z;
+	});
 
 }
 
@@ -449,39 +1153,269 @@ void PikopterNavdata::handleOrientation(const geometry_msgs::PoseStamped::ConstP
 	double roll, pitch, yaw;
 	matrix.getEulerYPR(yaw, pitch, roll);
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
+	/* ##### Publish through the seqlock ##### */
+	navdata_current.write([&](union navdata_t &navdata) {
+		// Updatas velocity datas
+		navdata.demo.theta = (float32_t)pitch;
+		navdata.demo.phi = (float32_t)roll;
+		navdata.demo.psi = (float32_t)yaw;
+	});
+}
+
 
-	// Updatas velocity datas
-	navdata_current.demo.theta = (float32_t)pitch;
-	navdata_current.demo.phi = (float32_t)roll;
-	navdata_current.demo.psi = (float32_t)yaw;
+/*!
+ * \brief Get the acknowledgment of a cmd received, from a cmd node in another process
+ */
+void PikopterNavdata::handleCmdReceived(const std_msgs::Bool::ConstPtr& /* status */) {
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+	ROS_DEBUG("Command acknowledgment received");
+
+	acknowledgeCommand();
 }
 
 
 /*!
- * \brief Get the acknowledgment of a cmd received
+ * \brief Acknowledge a command received by the cmd node
+ *
+ * Called by the topic handler, or directly by the cmd thread when both
+ * nodelets are in the same process.
  */
-void PikopterNavdata::handleCmdReceived(const std_msgs::Bool status) {
+void PikopterNavdata::acknowledgeCommand() {
 
-	ROS_DEBUG("Command acknowledgment received");
+	// The command received acknowledgment bit mask is put to 1 in the next packet
+	uint64_t none = 0;
+	bool first = cmd_ack_requested_ns.compare_exchange_strong(none, monotonicNs());
+
+	// Sent at once only if the bit goes up: during a stream of commands every packet carries it already
+	if (first && !ack_bit_sent) requestPush(false);
+}
 
-	/* ##### Enter Critical Section ##### */
-	navdata_mutex.lock();
 
-	// Put the command received acknowledgment bit mask to 1
-	navdata_current.demo.ardrone_state = navdata_current.demo.ardrone_state | 0x20;
+/*!
+ * \brief Handler attached to the CommandAckLink by the navdata nodelet
+ *
+ * \param navdata The PikopterNavdata object attached
+ */
+void PikopterNavdata::ackHandler(void *navdata) {
 
-	/* ##### Exit Critical Section ##### */
-	navdata_mutex.unlock();
+	static_cast<PikopterNavdata *>(navdata)->acknowledgeCommand();
 }
 
 
 /*!
- * \brief Main function
+ * \brief Reflect the state of the command link watchdog of the cmd node
+ */
+void PikopterNavdata::handleLinkState(const std_msgs::UInt8::ConstPtr& msg) {
+
+	ROS_DEBUG("Command link state %d received", msg->data);
+
+	/* ##### Publish through the seqlock ##### */
+	bool changed = false;
+	navdata_current.write([&](union navdata_t &navdata) {
+		uint32_t previous = navdata.demo.ardrone_state;
+
+		// Watchdog bit while hovering or landing because of the silence
+		if (msg->data == LINK_STATE_OK)
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state & ~ARDRONE_COM_WATCHDOG_MASK;
+		else
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state | ARDRONE_COM_WATCHDOG_MASK;
+
+		// Communication lost bit once the drone lands because of the silence
+		if (msg->data == LINK_STATE_LOST)
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state | ARDRONE_COM_LOST_MASK;
+		else
+			navdata.demo.ardrone_state = navdata.demo.ardrone_state & ~ARDRONE_COM_LOST_MASK;
+
+		// The watchdog bit alone waits for the periodic packet
+		changed = ((navdata.demo.ardrone_state ^ previous) & NAVDATA_PUSH_STATE_MASK) != 0;
+	});
+
+	// The client learns at once that the drone lands for lack of commands
+	if (changed) requestPush(true);
+}
+
+
+/*!
+ * \brief Switch between the demo and the full mode, asked by a client with AT*CONFIG
+ *
+ * \param msg True for the demo mode, false for the full mode
+ */
+void PikopterNavdata::handleNavdataDemo(const std_msgs::Bool::ConstPtr& msg) {
+
+	bool in_demo = msg->data;
+
+	// Nothing to do if already in this mode
+	if (in_demo == demo_mode) return;
+
+	ROS_INFO("Navdata switched to %s mode", in_demo ? "demo" : "full");
+
+	// The raw sensors are only needed in full mode
+	if (!in_demo) askMavrosRawSensors(true);
+
+	// The next packet uses the new serializer, the sender follows the new rate after it
+	demo_mode = in_demo;
+	requested_period_ns = 1000000000LL / (in_demo ? NAVDATA_DEMO_LOOP_RATE : NAVDATA_LOOP_RATE);
+
+	if (in_demo) askMavrosRawSensors(false);
+}
+
+
+/*!
+ * \brief Put the raw imu datas into the raw measures of the full mode
+ *
+ * \param msg The raw imu message from mavros
+ */
+void PikopterNavdata::handleImuRaw(const sensor_msgs::Imu::ConstPtr& msg) {
+
+	/* ##### Publish through the seqlock ##### */
+	sensors_current.write([&](struct navdata_sensors &sensors) {
+		sensors.acc[0] = msg->linear_acceleration.x;
+		sensors.acc[1] = msg->linear_acceleration.y;
+		sensors.acc[2] = msg->linear_acceleration.z;
+		sensors.gyro[0] = msg->angular_velocity.x;
+		sensors.gyro[1] = msg->angular_velocity.y;
+		sensors.gyro[2] = msg->angular_velocity.z;
+		sensors.imu_defined = true;
+	});
+}
+
+
+/*!
+ * \brief Put the gps fix into the gps option of the full mode
+ *
+ * \param msg The global position from mavros
+ */
+void PikopterNavdata::handleGps(const sensor_msgs::NavSatFix::ConstPtr& msg) {
+
+	ROS_DEBUG("Entered gps with (lat = %f, lon = %f, alt = %f)", msg->latitude, msg->longitude, msg->altitude);
+
+	// No fix, the option is not sent anymore
+	bool fix = (msg->status.status >= sensor_msgs::NavSatStatus::STATUS_FIX);
+
+	/* ##### Publish through the seqlock ##### */
+	sensors_current.write([&](struct navdata_sensors &sensors) {
+		sensors.latitude = msg->latitude;
+		sensors.longitude = msg->longitude;
+		sensors.elevation = msg->altitude;
+		sensors.gps_defined = fix;
+	});
+}
+
+
+/*!
+ * \brief Put the progress of the trajectory run by the cmd node into the trajectory option
+ *
+ * \param msg The progress, indexed by TRAJECTORY_FIELD_*
+ */
+void PikopterNavdata::handleTrajectory(const std_msgs::UInt32MultiArray::ConstPtr& msg) {
+
+	if (msg->data.size() < TRAJECTORY_FIELDS) {
+		ROS_WARN("Trajectory progress with %zu fields instead of %d", msg->data.size(), TRAJECTORY_FIELDS);
+		return;
+	}
+
+	/* ##### Publish through the seqlock ##### */
+	bool changed = false;
+	trajectory_current.write([&](struct navdata_trajectory_option &trajectory) {
+		changed = (trajectory.id != msg->data[TRAJECTORY_FIELD_ID] || trajectory.state != msg->data[TRAJECTORY_FIELD_STATE]
+			|| trajectory.point != msg->data[TRAJECTORY_FIELD_POINT]);
+
+		trajectory.id = msg->data[TRAJECTORY_FIELD_ID];
+		trajectory.state = msg->data[TRAJECTORY_FIELD_STATE];
+		trajectory.point = msg->data[TRAJECTORY_FIELD_POINT];
+		trajectory.points = msg->data[TRAJECTORY_FIELD_POINTS];
+		trajectory.elapsed_ms = msg->data[TRAJECTORY_FIELD_ELAPSED_MS];
+		trajectory.duration_ms = msg->data[TRAJECTORY_FIELD_DURATION_MS];
+	});
+
+	// The client learns at once that a point is reached or that the trajectory stopped
+	if (changed) requestPush(false);
+}
+
+
+/*!
+ * \brief Subscribe the handlers to the topics of mavros and of the cmd node
+ *
+ * \param node_handle The node handle of the subscriptions, its callback queue runs the handlers
+ */
+void PikopterNavdata::subscribe(ros::NodeHandle &node_handle) {
+
+	// Here we receive the navdatas from pikopter_mavlink
+	subscribers.push_back(node_handle.subscribe("mavros/global_position/rel_alt", SUB_BUF_SIZE_GLOBAL_POS_REL_ALT, &PikopterNavdata::getAltitude, this));
+
+	// Here we receive the battery state
+	subscribers.push_back(node_handle.subscribe("mavros/battery", SUB_BUF_SIZE_BATTERY, &PikopterNavdata::handleBattery, this));
+
+	// Here we receive the velocity
+	subscribers.push_back(node_handle.subscribe("mavros/local_position/velocity", SUB_BUF_SIZE_LOCAL_POS_GP_VEL, &PikopterNavdata::handleVelocity, this));
+
+	// Here we receive the imu position
+	subscribers.push_back(node_handle.subscribe("mavros/local_position/pose", SUB_BUF_SIZE_LOCAL_POS_POSE, &PikopterNavdata::handleOrientation, this));
+
+	// Here we receive the state of the drone
+	subscribers.push_back(node_handle.subscribe("mavros/extended_state", SUB_BUF_SIZE_EXTENDED_STATE, &PikopterNavdata::getExtendedState, this));
+
+	// Here we receive the acknowledgments of a cmd node running in another process
+	subscribers.push_back(node_handle.subscribe("pikopter_cmd/cmd_received", SUB_BUF_SIZE_CMD_RECEIVED, &PikopterNavdata::handleCmdReceived, this));
+
+	// Here we receive the state of the command link watchdog
+	subscribers.push_back(node_handle.subscribe("pikopter_cmd/link_state", SUB_BUF_SIZE_LINK_STATE, &PikopterNavdata::handleLinkState, this));
+
+	// Here we receive the raw imu, only sent in full mode
+	subscribers.push_back(node_handle.subscribe("mavros/imu/data_raw", SUB_BUF_SIZE_IMU_RAW, &PikopterNavdata::handleImuRaw, this));
+
+	// Here we receive the gps fix, only sent in full mode
+	subscribers.push_back(node_handle.subscribe("mavros/global_position/global", SUB_BUF_SIZE_GPS, &PikopterNavdata::handleGps, this));
+
+	// Here we receive the mode asked by the clients
+	subscribers.push_back(node_handle.subscribe("pikopter_cmd/navdata_demo", SUB_BUF_SIZE_NAVDATA_DEMO, &PikopterNavdata::handleNavdataDemo, this));
+
+	// Here we receive the progress of the trajectory run by the cmd node
+	subscribers.push_back(node_handle.subscribe("pikopter_cmd/trajectory", SUB_BUF_SIZE_TRAJECTORY, &PikopterNavdata::handleTrajectory, this));
+}
+
+
+/*!
+ * \brief Read the parameters of the node, shared by the standalone node and the nodelet
+ *
+ * \param private_node_handle The private node handle of the node
+ * \param params The parameters read
+ *
+ * \return False if the ip address is missing
+ */
+bool PikopterNavdata::readParams(ros::NodeHandle &private_node_handle, struct navdata_params &params) {
+
+	// Here, get the IP address
+	if (!private_node_handle.getParam("ip", params.ip)) {
+		ROS_FATAL("Navdata is missing its ip address");
+		return false;
+	}
+
+	// Demo mode by default, full mode sends all the option blocks
+	private_node_handle.param("demo_mode", params.demo_mode, true);
+
+	// Real time priority of the sender, 0 to keep the default policy
+	private_node_handle.param("sender_fifo_priority", params.fifo_priority, NAVDATA_SENDER_FIFO_PRIORITY);
+
+	// Packets pushed at once on important changes, with a minimum spacing
+	private_node_handle.param("event_push", params.event_push, true);
+	private_node_handle.param("push_min_spacing_ms", params.push_spacing_ms, NAVDATA_PUSH_MIN_SPACING_MS);
+
+	// Clients which joined with a wake-up are forgotten after this silence
+	private_node_handle.param("client_timeout_ms", params.client_timeout_ms, NAVDATA_CLIENT_TIMEOUT_MS);
+
+	// Number of threads for the callbacks
+	private_node_handle.param("spinner_threads", params.spinner_threads, NAVDATA_SPINNER_THREADS);
+
+	return true;
+}
+
+
+#ifndef PIKOPTER_NO_MAIN
+/*!
+ * \brief Main function of the standalone navdata node
+ * The same node can be loaded in a nodelet manager, see pikopter_nodelets.cpp:
+ * the nodelet library builds this file with PIKOPTER_NO_MAIN defined.
  *
  * \param argc The number of arguments
  * \param argv The arguments
@@ -498,68 +1432,51 @@ int main(int argc, char **argv) {
 	ros::NodeHandle navdata_node_handle;
 	ros::NodeHandle navdata_private_node_handle("~");
 
-	// Here, get the IP address
-	std::string ip;
-	if (!navdata_private_node_handle.getParam("ip", ip)) {
-		ROS_FATAL("Navdata is missing its ip address");
-		return ERROR_ENCOUNTERED;
-	}
+	// Get the parameters of the node
+	struct navdata_params params;
+	if (!PikopterNavdata::readParams(navdata_private_node_handle, params)) return ERROR_ENCOUNTERED;
 
 	// Create the table and store the ip into it
-	char cstr[ip.length() + 1];
-	strcpy(cstr, ip.c_str());
+	char cstr[params.ip.length() + 1];
+	strcpy(cstr, params.ip.c_str());
 
 	// Create a pikopter navdata object
-	// TODO: Later, we would be abble to choose between normal or demo mode
-	PikopterNavdata *pn = new PikopterNavdata(cstr, true);
+	PikopterNavdata *pn = new PikopterNavdata(cstr, params.demo_mode, navdata_node_handle);
+	if (!pn->isReady()) {
+		delete pn;
+		return ERROR_ENCOUNTERED;
+	}
 
 	// Get the rate for this node in function of the mode
 	int rate = (pn->inDemoMode()) ? NAVDATA_DEMO_LOOP_RATE : NAVDATA_LOOP_RATE;
-
-	// Put this rate
-	ros::Rate loop_rate(rate);
 	ROS_DEBUG("Navdata node initialized with a rate of %u", rate);
 
 
 	/* ##### All the subscribers to receive datas ##### */
-	// Here we receive the navdatas from pikopter_mavlink
-	ros::Subscriber sub_mavros_global_position_rel_alt = navdata_node_handle.subscribe("mavros/global_position/rel_alt", SUB_BUF_SIZE_GLOBAL_POS_REL_ALT, &PikopterNavdata::getAltitude, pn);
-
-	// Here we receive the battery state
-	ros::Subscriber sub_mavros_battery = navdata_node_handle.subscribe("mavros/battery", SUB_BUF_SIZE_BATTERY, &PikopterNavdata::handleBattery, pn);
-
-	// Here we receive the velocity
-	ros::Subscriber sub_mavros_local_position_gp_vel = navdata_node_handle.subscribe("mavros/local_position/velocity", SUB_BUF_SIZE_LOCAL_POS_GP_VEL, &PikopterNavdata::handleVelocity, pn);
-
-	// Here we receive the imu position
-	ros::Subscriber sub_mavros_local_position_pose = navdata_node_handle.subscribe("mavros/local_position/pose", SUB_BUF_SIZE_LOCAL_POS_POSE, &PikopterNavdata::handleOrientation, pn);
-
-	// Here we receive the state of the drone
-	ros::Subscriber sub_mavros_extended_state = navdata_node_handle.subscribe("mavros/extended_state", SUB_BUF_SIZE_EXTENDED_STATE, &PikopterNavdata::getExtendedState, pn);
-
-	// Here we receive the state of the drone
-	ros::Subscriber sub_pikopter_cmd_cmd_received = navdata_node_handle.subscribe("pikopter_cmd/cmd_received", SUB_BUF_SIZE_CMD_RECEIVED, &PikopterNavdata::handleCmdReceived, pn);
+	pn->subscribe(navdata_node_handle);
 
 	// We change the state of the navdata to say that it is sending navdatas
 	pn->setBitEndOfBootstrap();
 
-	// Here we'll spin and send navdatas periodically
-	while(ros::ok()) {
-
-		// Display the state of the navdata (for debug)
-		pn->display();
+	// The callbacks run on their own threads, the seqlock keeps the sender from waiting on them
+	ros::AsyncSpinner spinner(params.spinner_threads);
+	spinner.start();
 
-		// And then we send it
-		pn->sendNavdata();
+	// Here we send navdatas periodically from the sender thread
+	if (!pn->startSender(rate, params.fifo_priority, params.event_push, params.push_spacing_ms, params.client_timeout_ms)) {
+		spinner.stop();
+		delete pn;
+		return ERROR_ENCOUNTERED;
+	}
 
-		// Spin once
-		ros::spinOnce();
+	// Wait for the end of the node
+	ros::waitForShutdown();
 
-		// Pause in loop with the given value defined in ros::rate
-		loop_rate.sleep();
-	}
+	// Stop sending before the callbacks
+	pn->stopSender();
+	spinner.stop();
 
-	ROS_DEBUG("Exited the ros::ok() loop of navdata node. Goodbye!");
+	ROS_DEBUG("Exited the navdata node. Goodbye!");
 
 	// Destroy the PikopterNavdata object before leaving the program
 	delete pn;
@@ -567,3 +1484,4 @@ int main(int argc, char **argv) {
 	// Return the correct end status
 	return NO_ERROR_ENCOUNTERED;
 }
+#endif
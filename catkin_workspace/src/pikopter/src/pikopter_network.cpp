@@ -1,6 +1,9 @@
 // Include the common.h
 #include "../include/pikopter/pikopter_common.h"
 
+// For the concurrent waits of the services
+#include "future"
+
 
 /*!
  * \brief Open an UDP socket
@@ -34,7 +37,8 @@ int PikopterNetwork::open_udp_socket(int portnum, struct sockaddr_in *serv_addr,
 		// If en error occurs during converting the station's IP into formatted IP format
 		if (inet_aton(station_ip, &(serv_addr->sin_addr)) == 0) {
 			ROS_FATAL("inet_aton() failed on %s:%d", station_ip, portnum);
-			exit(ERROR_ENCOUNTERED);
+			close(listenfd);
+			return ERROR_ENCOUNTERED;
 		}
 		ROS_INFO("Socket connected on %s:%d", station_ip, portnum);
 	}
@@ -42,3 +46,70 @@ int PikopterNetwork::open_udp_socket(int portnum, struct sockaddr_in *serv_addr,
 	// Return the value of the fd or -1 if error
 	return listenfd;
 }
+
+
+/*!
+ * \brief Bind an UDP socket on a local port, to receive the datagrams sent to it
+ *
+ * \param fd The socket
+ * \param portnum The local port
+ *
+ * \return 0 or -1 if error
+ */
+int PikopterNetwork::bind_udp_socket(int fd, int portnum) {
+
+	// Allow a quick restart of the node
+	int enable = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	// Listen on every interface
+	struct sockaddr_in local_addr;
+	memset(&local_addr, 0, sizeof(local_addr));
+	local_addr.sin_family = AF_INET;
+	local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	local_addr.sin_port = htons(portnum);
+
+	if (bind(fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+		ROS_ERROR("bind() failed on port %d: %s", portnum, strerror(errno));
+		return ERROR_ENCOUNTERED;
+	}
+
+	ROS_INFO("Socket listening on port %d", portnum);
+	return NO_ERROR_ENCOUNTERED;
+}
+
+
+/*!
+ * \brief Wait for several services at the same time
+ *
+ * Every service is waited for on its own thread against the same deadline,
+ * so the whole wait lasts as long as the slowest service, at most timeout_ms.
+ *
+ * \param services The names of the services
+ * \param timeout_ms The deadline, from now
+ *
+ * \return The number of services still unavailable at the deadline
+ */
+int PikopterNetwork::wait_for_services(const std::vector<std::string> &services, int timeout_ms) {
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Launch all the waits
+	std::vector<std::future<bool> > waits;
+	for (const std::string &service : services)
+		waits.push_back(std::async(std::launch::async, [service, timeout_ms]() {
+			return ros::service::waitForService(service, timeout_ms);
+		}));
+
+	// Then collect them
+	int missing = 0;
+	for (size_t k = 0; k < services.size(); k++) {
+		if (waits[k].get()) continue;
+		ROS_ERROR("Service %s still unavailable after %dms", services[k].c_str(), timeout_ms);
+		missing++;
+	}
+
+	long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	ROS_INFO("%d of %d services available after %ldms", (int)services.size() - missing, (int)services.size(), elapsed_ms);
+	return missing;
+}
@@ -0,0 +1,134 @@
+// Include pikopter nodelets headers
+#include "../include/pikopter/pikopter_nodelets.h"
+
+// The plugin library lib/libpikopter_nodelets (target pikopter_nodelets of CMakeLists.txt)
+// is this file with pikopter_cmd.cpp, pikopter_navdata.cpp and pikopter_network.cpp, all
+// built with PIKOPTER_NO_MAIN defined: the main() of the standalone nodes stay in their sources.
+
+#include "pluginlib/class_list_macros.h"
+
+
+namespace pikopter {
+
+
+/*!
+ * \brief Constructor of CmdNodelet, the node is created by onInit
+ */
+CmdNodelet::CmdNodelet() {
+}
+
+
+/*!
+ * \brief Destructor of CmdNodelet
+ * Stop the event loop before destroying the node it runs.
+ */
+CmdNodelet::~CmdNodelet() {
+
+	if (pik) pik->stop();
+	if (loop_thread.joinable()) loop_thread.join();
+	if (pik) pik->displayStats();
+
+	// The subscriptions go before the queue they use
+	executeCommand.reset();
+	pik.reset();
+}
+
+
+/*!
+ * \brief Create the cmd node and start its event loop
+ */
+void CmdNodelet::onInit() {
+
+	ros::NodeHandle &cmd_private_nh = getPrivateNodeHandle();
+
+	struct cmd_params params;
+	if (!PikopterCmd::readParams(cmd_private_nh, params)) return;
+
+	std::vector<char> cstr(params.ip.begin(), params.ip.end());
+	cstr.push_back('\0');
+
+	NODELET_INFO("Adresse ip : %s", cstr.data());
+
+	// Same objects as the standalone node, the topics are resolved in the namespace of the nodelet
+	pik.reset(new PikopterCmd(cstr.data(), params.batch_size, params.max_age_ms, params.ping_period_ms, params.hover_ms, params.land_ms,
+		params.pilot_ip.c_str(), params.pilot_timeout_ms));
+	if (!pik->ready()) {
+		NODELET_FATAL("Unable to open the command socket, the cmd nodelet is not started");
+		pik.reset();
+		return;
+	}
+
+	executeCommand.reset(new ExecuteCommand(getNodeHandle(), cmd_private_nh, &callback_queue));
+	if (!executeCommand->ready() || !pik->watch(callback_queue)) {
+		NODELET_FATAL("Unable to start the threads and the event loop, the cmd nodelet is not started");
+		executeCommand.reset();
+		pik.reset();
+		return;
+	}
+
+	// onInit must return, the event loop gets its own thread
+	loop_thread = std::thread(&PikopterCmd::run, pik.get(), std::ref(*executeCommand), std::ref(callback_queue));
+}
+
+
+/*!
+ * \brief Constructor of NavdataNodelet, the node is created by onInit
+ */
+NavdataNodelet::NavdataNodelet() {
+}
+
+
+/*!
+ * \brief Destructor of NavdataNodelet
+ * The cmd nodelet falls back to the topic once the handler is detached.
+ */
+NavdataNodelet::~NavdataNodelet() {
+
+	if (!pn) return;
+
+	CommandAckLink::detach(pn.get());
+	pn->stopSender();
+	pn.reset();
+}
+
+
+/*!
+ * \brief Create the navdata node, subscribe it and start its sender
+ */
+void NavdataNodelet::onInit() {
+
+	struct navdata_params params;
+	if (!PikopterNavdata::readParams(getPrivateNodeHandle(), params)) return;
+
+	std::vector<char> cstr(params.ip.begin(), params.ip.end());
+	cstr.push_back('\0');
+
+	pn.reset(new PikopterNavdata(cstr.data(), params.demo_mode, getNodeHandle()));
+	if (!pn->isReady()) {
+		NODELET_FATAL("Unable to open the navdata socket, the navdata nodelet is not started");
+		pn.reset();
+		return;
+	}
+
+	// The handlers run concurrently on the threads of the manager, like with the spinner of the standalone node
+	pn->subscribe(getMTNodeHandle());
+
+	// We change the state of the navdata to say that it is sending navdatas
+	pn->setBitEndOfBootstrap();
+
+	// A cmd nodelet of this process acknowledges its commands without the topic
+	CommandAckLink::attach(&PikopterNavdata::ackHandler, pn.get());
+
+	int rate = (pn->inDemoMode()) ? NAVDATA_DEMO_LOOP_RATE : NAVDATA_LOOP_RATE;
+	if (!pn->startSender(rate, params.fifo_priority, params.event_push, params.push_spacing_ms, params.client_timeout_ms)) {
+		NODELET_FATAL("Unable to start the navdata sender, the navdata nodelet is not started");
+		CommandAckLink::detach(pn.get());
+		pn.reset();
+	}
+}
+
+}
+
+
+PLUGINLIB_EXPORT_CLASS(pikopter::CmdNodelet, nodelet::Nodelet)
+PLUGINLIB_EXPORT_CLASS(pikopter::NavdataNodelet, nodelet::Nodelet)
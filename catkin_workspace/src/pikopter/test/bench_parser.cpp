@@ -0,0 +1,131 @@
+// Benchmark of the AT tokenizer against the former sscanf chain
+#include "../include/pikopter/pikopter_cmd.h"
+
+#include <chrono>
+
+
+/* ################################### CONSTANTS ################################### */
+// Commands parsed by each parser
+#define BENCH_COMMANDS 2000000
+
+// Commands of the stream, cycled over
+#define BENCH_STREAM_SIZE 100
+
+
+
+/*!
+ * \brief The former parser: one sscanf per known prefix until one of them matches
+ *
+ * \param buf the command, null terminated
+ * \param values the sequence number then the arguments
+ *
+ * \return the number of values read, 0 for an unknown command
+ */
+static int parseSscanf(const char *buf, int32_t values[6]) {
+	int seq, tcmd, p1, p2, p3, p4, p5;
+
+	if (sscanf(buf, "AT*FTRIM=%d", &seq) == 1) {
+		values[0] = seq;
+		return 1;
+	}
+	else if (sscanf(buf, "AT*REF=%d, %d", &seq, &tcmd) == 2) {
+		values[0] = seq;
+		values[1] = tcmd;
+		return 2;
+	}
+	else if (sscanf(buf, "AT*PCMD=%d, %d, %d, %d, %d, %d", &seq, &p1, &p2, &p3, &p4, &p5) == 6) {
+		values[0] = seq;
+		values[1] = p1; values[2] = p2; values[3] = p3; values[4] = p4; values[5] = p5;
+		return 6;
+	}
+
+	return 0;
+}
+
+
+/*!
+ * \brief The tokenizer of the cmd node, on the same command
+ *
+ * \return the number of values read, 0 for an unknown or malformed command
+ */
+static int parseTokenizer(const char *buf, int len, int32_t values[6]) {
+	struct at_command command;
+
+	if (!tokenizeCommand(buf, buf + len, command) || command.verb == AT_UNKNOWN) return 0;
+
+	values[0] = command.seq;
+	for (int k = 0; k < command.nargs && k < 5; ++k) values[k + 1] = command.args[k].value;
+	return 1 + command.nargs;
+}
+
+
+/*!
+ * \brief Stream of a client flying the drone at 30Hz: a REF and a PCMD by cycle,
+ * a COMWDG from time to time and a few CONFIG
+ */
+static void buildStream(std::vector<std::string> &stream) {
+	static const char *sticks[] = { "0", "1056964608", "-1090519040", "1036831949", "-1082130432" };
+
+	for (int seq = 1; (int) stream.size() < BENCH_STREAM_SIZE; ++seq) {
+		char buf[PACKET_SIZE];
+
+		if (seq % 20 == 0) snprintf(buf, sizeof(buf), "AT*COMWDG=%d\r", seq);
+		else if (seq % 33 == 0) snprintf(buf, sizeof(buf), "AT*CONFIG=%d,\"general:navdata_demo\",\"TRUE\"\r", seq);
+		else if (seq % 2 == 0) snprintf(buf, sizeof(buf), "AT*REF=%d,290718208\r", seq);
+		else snprintf(buf, sizeof(buf), "AT*PCMD=%d,1,%s,%s,0,%s\r", seq, sticks[seq % 5], sticks[(seq + 1) % 5], sticks[(seq + 3) % 5]);
+
+		stream.push_back(buf);
+	}
+}
+
+
+/*!
+ * \brief Time a parser over the stream
+ *
+ * \return the mean time of a command in nanoseconds
+ */
+template <typename P>
+static double timeParser(const std::vector<std::string> &stream, P parse, long &checksum) {
+	int32_t values[6];
+	checksum = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int k = 0; k < BENCH_COMMANDS; ++k) {
+		const std::string &command = stream[k % stream.size()];
+		int n = parse(command, values);
+		for (int v = 0; v < n; ++v) checksum += values[v];
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double) BENCH_COMMANDS;
+}
+
+
+int main() {
+	std::vector<std::string> stream;
+	buildStream(stream);
+
+	// Both parsers must read the same values from the commands known by the sscanf chain
+	for (size_t k = 0; k < stream.size(); ++k) {
+		int32_t old_values[6], new_values[6];
+		int n = parseSscanf(stream[k].c_str(), old_values);
+		if (n == 0) continue;
+		if (parseTokenizer(stream[k].c_str(), (int) stream[k].size(), new_values) != n || memcmp(old_values, new_values, n * sizeof(int32_t)) != 0) {
+			printf("Parsers disagree on %s\n", stream[k].c_str());
+			return 1;
+		}
+	}
+
+	long checksum_sscanf, checksum_tokenizer;
+	double sscanf_ns = timeParser(stream, [](const std::string &c, int32_t *v) { return parseSscanf(c.c_str(), v); }, checksum_sscanf);
+	double tokenizer_ns = timeParser(stream, [](const std::string &c, int32_t *v) { return parseTokenizer(c.c_str(), (int) c.size(), v); }, checksum_tokenizer);
+
+	printf("AT parser, %d commands (PCMD, REF, COMWDG, CONFIG)\n", BENCH_COMMANDS);
+	printf("  sscanf chain: %8.1f ns/command\n", sscanf_ns);
+	printf("  tokenizer:    %8.1f ns/command (x%.1f)\n", tokenizer_ns, sscanf_ns / tokenizer_ns);
+
+	// Keeps the values alive
+	if (checksum_sscanf == 1 && checksum_tokenizer == 1) printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+// Contention benchmark of the navdata seqlock against the former navdata mutex
+#include "../include/pikopter/pikopter_navdata.h"
+
+#include <chrono>
+#include <thread>
+
+
+/* ################################### CONSTANTS ################################### */
+// Duration of each run
+#define BENCH_DURATION_MS 1000
+
+// Callbacks writing the navdata, as with a multi-threaded spinner
+#define BENCH_WRITERS 2
+
+
+
+/*!
+ * \brief The former navdata: every callback and the sender take the same mutex
+ */
+class MutexNavdata {
+
+	public:
+		template <typename F>
+		void write(F update) {
+			std::lock_guard<std::mutex> lock(mutex);
+			update(value);
+		}
+
+		void read(union navdata_t &snapshot) {
+			std::lock_guard<std::mutex> lock(mutex);
+			memcpy(&snapshot, &value, sizeof(snapshot));
+		}
+
+	private:
+		union navdata_t value;
+		std::mutex mutex;
+};
+
+
+/*!
+ * \brief Result of a run, seen from the sender
+ */
+struct bench_result {
+	double reads_per_s;
+	double writes_per_s;
+	double read_mean_ns;
+	long read_max_ns;
+	long torn;  // Copies mixing two writes, must stay 0
+};
+
+
+/*!
+ * \brief Hammer the navdata with the writers while the sender copies it as fast as it can
+ * Each write sets the altitude and the battery to the same counter, so a copy where they
+ * differ is torn.
+ */
+template <typename L>
+static struct bench_result run(L &navdata) {
+	std::atomic<bool> stop(false);
+	std::atomic<long> writes(0);
+	std::vector<std::thread> writers;
+
+	navdata.write([](union navdata_t &n) { memset(&n, 0, sizeof(n)); });
+
+	for (int w = 0; w < BENCH_WRITERS; ++w) {
+		writers.push_back(std::thread([&]() {
+			long count = 0;
+			while (!stop.load(std::memory_order_relaxed)) {
+				navdata.write([&](union navdata_t &n) {
+					++count;
+					n.demo.altitude = (int32_t) count;
+					n.demo.vbat_flying_percentage = (uint32_t) count;
+				});
+			}
+			writes += count;
+		}));
+	}
+
+	struct bench_result result = {0, 0, 0, 0, 0};
+	long reads = 0, total_ns = 0;
+	union navdata_t snapshot;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point end = start + std::chrono::milliseconds(BENCH_DURATION_MS);
+	std::chrono::steady_clock::time_point now = start;
+	while (now < end) {
+		navdata.read(snapshot);
+		std::chrono::steady_clock::time_point after = std::chrono::steady_clock::now();
+
+		long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(after - now).count();
+		total_ns += ns;
+		result.read_max_ns = std::max(result.read_max_ns, ns);
+		if (snapshot.demo.altitude != (int32_t) snapshot.demo.vbat_flying_percentage) ++result.torn;
+		++reads;
+		now = after;
+	}
+
+	stop = true;
+	for (size_t w = 0; w < writers.size(); ++w) writers[w].join();
+
+	result.reads_per_s = reads * 1000.0 / BENCH_DURATION_MS;
+	result.writes_per_s = writes * 1000.0 / BENCH_DURATION_MS;
+	result.read_mean_ns = total_ns / (double) reads;
+	return result;
+}
+
+
+static void print(const char *name, const struct bench_result &result) {
+	printf("  %-8s reads %6.2f M/s (mean %6.1f ns, max %8ld ns), writes %6.2f M/s, torn %ld\n", name,
+		result.reads_per_s / 1e6, result.read_mean_ns, result.read_max_ns, result.writes_per_s / 1e6, result.torn);
+}
+
+
+int main() {
+	static MutexNavdata mutex_navdata;
+	static Seqlock<union navdata_t> seqlock_navdata;
+
+	struct bench_result mutex_result = run(mutex_navdata);
+	struct bench_result seqlock_result = run(seqlock_navdata);
+
+	printf("Navdata snapshot (%zu bytes), %d writers and the sender, %d ms\n", sizeof(union navdata_t), BENCH_WRITERS, BENCH_DURATION_MS);
+	print("mutex", mutex_result);
+	print("seqlock", seqlock_result);
+
+	return (mutex_result.torn || seqlock_result.torn) ? 1 : 0;
+}
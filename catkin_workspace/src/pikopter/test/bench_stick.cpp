@@ -0,0 +1,81 @@
+// Benchmark of the stick decoding against the former table, without its logs
+#include "../include/pikopter/pikopter_cmd.h"
+
+#include <chrono>
+
+
+/* ################################### CONSTANTS ################################### */
+// Axes decoded by each converter
+#define BENCH_AXES 50000000
+
+
+
+/*!
+ * \brief The former converter: a switch over the values sent by Jakopter,
+ * not inlined, like decodeStick() which lives in another translation unit
+ */
+__attribute__((noinline)) static float convertSwitch(int speed) {
+	switch(speed) {
+		case 1028443341 : return 0.05;
+		case 1036831949 : return 0.1;
+		case 1045220557 : return 0.2;
+		case 1048576000 : return 0.25;
+		case 1056964608 : return 0.5;
+		case 1061158912 : return 0.75;
+		case 1065353216 : return 1.0;
+		case -1119040307 : return -0.05;
+		case -1110651699 : return -0.1;
+		case -1102263091 : return -0.2;
+		case -1098907648 : return -0.25;
+		case -1090519040 : return -0.5;
+		case -1086324736 : return -0.75;
+		case -1082130432 : return -1.0;
+		default : return 0.0;
+	}
+}
+
+
+/*!
+ * \brief Time a converter over the sticks
+ *
+ * \return the mean time of an axis in nanoseconds
+ */
+template <typename C>
+static double timeConverter(const std::vector<int> &sticks, C convert, float &checksum) {
+	checksum = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int k = 0; k < BENCH_AXES; ++k) checksum += convert(sticks[k % sticks.size()]);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double) BENCH_AXES;
+}
+
+
+int main() {
+	static const int table[] = {
+		1028443341, 1036831949, 1045220557, 1048576000, 1056964608, 1061158912, 1065353216,
+		-1119040307, -1110651699, -1102263091, -1098907648, -1090519040, -1086324736, -1082130432, 0
+	};
+
+	// Random walk over the table so that the branches cannot be predicted
+	std::vector<int> sticks;
+	unsigned int state = 1;
+	for (int k = 0; k < 4096; ++k) {
+		state = state * 1103515245 + 12345;
+		sticks.push_back(table[(state >> 16) % (sizeof(table) / sizeof(table[0]))]);
+	}
+
+	float checksum_switch, checksum_decode;
+	double switch_ns = timeConverter(sticks, convertSwitch, checksum_switch);
+	double decode_ns = timeConverter(sticks, [](int speed) { return ExecuteCommand::decodeStick(speed, 0.0f, 1.0f, 0.0f); }, checksum_decode);
+
+	printf("Stick decoding, %d axes\n", BENCH_AXES);
+	printf("  switch: %8.2f ns/axis\n", switch_ns);
+	printf("  decode: %8.2f ns/axis (x%.1f)\n", decode_ns, switch_ns / decode_ns);
+
+	// Keeps the values alive
+	if (checksum_switch == 1 && checksum_decode == 1) printf("\n");
+
+	return 0;
+}
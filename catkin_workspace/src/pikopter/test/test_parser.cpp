@@ -0,0 +1,146 @@
+// Checks of the AT tokenizer against the former sscanf chain, and of the sequence filter
+#include "../include/pikopter/pikopter_cmd.h"
+
+#include <gtest/gtest.h>
+
+
+/*!
+ * \brief The former parser: one sscanf per known prefix until one of them matches
+ *
+ * \param buf the command, null terminated
+ * \param values the sequence number then the arguments
+ *
+ * \return the number of values read, 0 for an unknown command
+ */
+static int parseSscanf(const char *buf, int32_t values[6]) {
+	int seq, tcmd, p1, p2, p3, p4, p5;
+
+	if (sscanf(buf, "AT*FTRIM=%d", &seq) == 1) {
+		values[0] = seq;
+		return 1;
+	}
+	else if (sscanf(buf, "AT*REF=%d, %d", &seq, &tcmd) == 2) {
+		values[0] = seq;
+		values[1] = tcmd;
+		return 2;
+	}
+	else if (sscanf(buf, "AT*PCMD=%d, %d, %d, %d, %d, %d", &seq, &p1, &p2, &p3, &p4, &p5) == 6) {
+		values[0] = seq;
+		values[1] = p1; values[2] = p2; values[3] = p3; values[4] = p4; values[5] = p5;
+		return 6;
+	}
+
+	return 0;
+}
+
+
+/*!
+ * \brief The tokenizer of the cmd node, on the same command
+ *
+ * \return the number of values read, 0 for an unknown or malformed command
+ */
+static int parseTokenizer(const char *buf, int32_t values[6]) {
+	struct at_command command;
+
+	if (!tokenizeCommand(buf, buf + strlen(buf), command) || command.verb == AT_UNKNOWN) return 0;
+
+	values[0] = command.seq;
+	for (int k = 0; k < command.nargs && k < 5; ++k) values[k + 1] = command.args[k].value;
+	return 1 + command.nargs;
+}
+
+
+/*!
+ * \brief Tokenize a command and check its sequence number against the client
+ */
+static bool accept(struct cmd_client &client, struct parser_stats &stats, const char *buf) {
+	struct at_command command;
+
+	if (!tokenizeCommand(buf, buf + strlen(buf), command)) return false;
+	return acceptSequence(client, command, stats);
+}
+
+
+TEST(Tokenizer, MatchesSscanfChain) {
+	static const char *commands[] = {
+		"AT*FTRIM=1\r",
+		"AT*REF=2,290718208\r",
+		"AT*REF=3, 290717696\r",
+		"AT*PCMD=4,1,1056964608,-1090519040,0,1036831949\r",
+		"AT*PCMD=5,0,0,0,0,0\r",
+		"AT*PCMD=6,1,-1082130432,1065353216,-1119040307,1028443341\r",
+	};
+
+	for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); ++k) {
+		int32_t old_values[6], new_values[6];
+		int n = parseSscanf(commands[k], old_values);
+		ASSERT_GT(n, 0) << commands[k];
+		ASSERT_EQ(n, parseTokenizer(commands[k], new_values)) << commands[k];
+		EXPECT_EQ(0, memcmp(old_values, new_values, n * sizeof(int32_t))) << commands[k];
+	}
+}
+
+TEST(Tokenizer, ReadsStringsAndConsecutiveCommands) {
+	const char *buf = "AT*CONFIG=7,\"general:navdata_demo\",\"TRUE\"\rAT*COMWDG=8\r";
+	const char *end = buf + strlen(buf);
+	struct at_command command;
+
+	const char *next = tokenizeCommand(buf, end, command);
+	ASSERT_TRUE(next != NULL);
+	EXPECT_EQ(AT_CONFIG, command.verb);
+	EXPECT_EQ(7, command.seq);
+	ASSERT_EQ(2, command.nargs);
+	EXPECT_EQ(std::string("general:navdata_demo"), std::string(command.args[0].str, command.args[0].len));
+	EXPECT_EQ(std::string("TRUE"), std::string(command.args[1].str, command.args[1].len));
+
+	next = tokenizeCommand(next, end, command);
+	ASSERT_TRUE(next != NULL);
+	EXPECT_EQ(AT_COMWDG, command.verb);
+	EXPECT_EQ(8, command.seq);
+	EXPECT_EQ(end, next);
+}
+
+TEST(Tokenizer, RejectsMalformedCommands) {
+	static const char *commands[] = {
+		"REF=1,290718208\r",
+		"AT*REF\r",
+		"AT*REF=x\r",
+		"AT*REF=1,29071x\r",
+		"AT*CONFIG=1,\"general:navdata_demo\r",
+	};
+	struct at_command command;
+
+	for (size_t k = 0; k < sizeof(commands) / sizeof(commands[0]); ++k)
+		EXPECT_TRUE(tokenizeCommand(commands[k], commands[k] + strlen(commands[k]), command) == NULL) << commands[k];
+}
+
+TEST(Sequence, DropsDuplicatesAndStaleCommands) {
+	struct cmd_client client;
+	struct parser_stats stats;
+	memset(&client, 0, sizeof(client));
+	memset(&stats, 0, sizeof(stats));
+
+	EXPECT_TRUE(accept(client, stats, "AT*PCMD=10,0,0,0,0,0\r"));
+	EXPECT_FALSE(accept(client, stats, "AT*PCMD=10,0,0,0,0,0\r"));
+	EXPECT_FALSE(accept(client, stats, "AT*PCMD=9,0,0,0,0,0\r"));
+	EXPECT_TRUE(accept(client, stats, "AT*PCMD=11,0,0,0,0,0\r"));
+	EXPECT_EQ(1u, stats.dropped_duplicate);
+	EXPECT_EQ(1u, stats.dropped_stale);
+}
+
+TEST(Sequence, ResetsOnlyForwardOrOnTheResetValue) {
+	struct cmd_client client;
+	struct parser_stats stats;
+	memset(&client, 0, sizeof(client));
+	memset(&stats, 0, sizeof(stats));
+
+	EXPECT_TRUE(accept(client, stats, "AT*PCMD=10,0,0,0,0,0\r"));
+
+	// A reordered watchdog is stale, it does not rewind the numbering
+	EXPECT_FALSE(accept(client, stats, "AT*COMWDG=5\r"));
+	EXPECT_FALSE(accept(client, stats, "AT*PCMD=6,0,0,0,0,0\r"));
+
+	// The client restarts its numbering
+	EXPECT_TRUE(accept(client, stats, "AT*COMWDG=1\r"));
+	EXPECT_TRUE(accept(client, stats, "AT*PCMD=2,0,0,0,0,0\r"));
+}
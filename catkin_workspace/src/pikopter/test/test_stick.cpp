@@ -0,0 +1,70 @@
+// Check of the stick decoding against the table of the former converter
+#include "../include/pikopter/pikopter_cmd.h"
+
+#include <gtest/gtest.h>
+#include <limits>
+
+
+/*!
+ * \brief Stick values sent by Jakopter and the rate the former table gave for them
+ */
+static const struct {
+	int speed;
+	float rate;
+} reference[] = {
+	{ 1028443341, 0.05 },
+	{ 1036831949, 0.1 },
+	{ 1045220557, 0.2 },
+	{ 1048576000, 0.25 },
+	{ 1056964608, 0.5 },
+	{ 1061158912, 0.75 },
+	{ 1065353216, 1.0 },
+	{ -1119040307, -0.05 },
+	{ -1110651699, -0.1 },
+	{ -1102263091, -0.2 },
+	{ -1098907648, -0.25 },
+	{ -1090519040, -0.5 },
+	{ -1086324736, -0.75 },
+	{ -1082130432, -1.0 },
+};
+
+
+/*!
+ * \brief Decode a stick value without shaping, as the node does with the default params
+ */
+static float decode(int speed) {
+	return ExecuteCommand::decodeStick(speed, 0.0f, 1.0f, 0.0f);
+}
+
+
+/*!
+ * \brief The int32 the protocol sends for a float
+ */
+static int encode(float rate) {
+	int speed;
+	memcpy(&speed, &rate, sizeof(speed));
+	return speed;
+}
+
+
+TEST(Stick, MatchesTheFormerTable) {
+	for (size_t k = 0; k < sizeof(reference) / sizeof(reference[0]); ++k)
+		EXPECT_EQ(reference[k].rate, decode(reference[k].speed)) << reference[k].speed;
+}
+
+TEST(Stick, StopsTheAxisOnZeroAndNaN) {
+	EXPECT_EQ(0.0f, decode(0));
+	EXPECT_EQ(0.0f, decode(encode(std::numeric_limits<float>::quiet_NaN())));
+}
+
+TEST(Stick, ClampsOutOfRangeValues) {
+	EXPECT_EQ(1.0f, decode(encode(3.0f)));
+	EXPECT_EQ(-1.0f, decode(encode(-3.0f)));
+}
+
+TEST(Stick, ShapingKeepsTheEndsOfTheStick) {
+	// The deadband keeps the full stick at 1, the expo keeps the ends of the stick
+	EXPECT_EQ(0.0f, ExecuteCommand::decodeStick(encode(0.1f), 0.2f, 1.0f / 0.8f, 0.0f));
+	EXPECT_EQ(1.0f, ExecuteCommand::decodeStick(encode(1.0f), 0.2f, 1.0f / 0.8f, 0.0f));
+	EXPECT_EQ(-1.0f, ExecuteCommand::decodeStick(encode(-1.0f), 0.0f, 1.0f, 1.0f));
+}